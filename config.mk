@@ -12,6 +12,8 @@ CFLAGS		 = -c $(PLAT_CFLAGS) $(PLAT_DEFINES) $(PLAT_INCS)
 LDFLAGS		 = $(PLAT_LDFLAGS) 
 LIBS			 = $(PLAT_LIBS)
 #DEFINES		 = -DDEBUG=1 -DTRACE=1
+# Make every lc_spin_new() lock a fair ticket lock
+#DEFINES		 = -DLC_SPIN_DEFAULT=LC_SPIN_TICKET
 
 # Lua install directories
 LUA_DIR=/usr/local
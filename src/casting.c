@@ -11,11 +11,17 @@
 #include "lc_error.h"
 #include "lc_thread.h"
 
-static const luaL_Reg funcs[] = { { NULL, NULL } };
+static const luaL_Reg funcs[] = { { "yield", lc_task_yield },
+                                  { "sleep", lc_task_sleep },
+                                  { "select", lc_select },
+                                  { NULL, NULL } };
 
 static const luaL_Reg packages[] = { { "Session", lc_open_session },
                                       { "Message", lc_open_message },
                                       { "Channel", lc_open_channel },
+                                      { "Group", lc_open_group },
+                                      { "IO", lc_open_io },
+                                      { "Broadcast", lc_open_broadcast },
                                       { NULL, NULL } };
 
 LUALIB_API int luaopen_casting(lua_State *L) {
@@ -25,6 +25,9 @@ LUALIB_API int luaopen_casting(lua_State *L);
 int lc_open_message(lua_State *L);
 int lc_open_channel(lua_State *L);
 int lc_open_session(lua_State *L);
+int lc_open_group(lua_State *L);
+int lc_open_io(lua_State *L);
+int lc_open_broadcast(lua_State *L);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,191 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "casting.h"
+#include "lc_atomic.h"
+#include "lc_arena.h"
+
+static const size_t class_size[ARENA_CLASSES] = { 16, 32, 48, 64, 80, 96, 112, 128,
+                                                  160, 192, 224, 256, 320, 384, 448, 512 };
+
+// size class of each multiple of 16 bytes up to ARENA_SMALL
+static unsigned char class_of[ARENA_SMALL / 16 + 1];
+
+typedef struct _block {
+  struct _block *next;
+} block_t;
+
+// pages are chained through a header that keeps the blocks after it 16 byte aligned
+typedef union _page {
+  union _page *next;
+  char align[16];
+} page_t;
+
+// large blocks are never smaller than this, so that any of them can be made into a page
+#define LARGE_MIN   (ARENA_SMALL + sizeof(page_t))
+
+struct _lc_arena {
+  block_t *free[ARENA_CLASSES];
+  page_t *pages;
+  char *top;
+  char *end;
+  size_t live;
+  size_t peak;
+  volatile size_t limit;
+};
+
+static void init_classes( ) {
+  static int init = 0;
+
+  while (!atomic_int_cas(&init, 1, 1)) {
+    int c = 0;
+    for (int i = 0; i <= ARENA_SMALL / 16; i++) {
+      while (class_size[c] < i * 16) c++;
+      class_of[i] = c;
+    }
+    init = 1;
+  }
+}
+
+static inline int size_class(size_t size) {
+  return class_of[(size + 15) >> 4];
+}
+
+lc_arena_t *lc_arena_new( ) {
+  init_classes();
+  lc_arena_t *a = malloc(sizeof(lc_arena_t));
+  if (a) {
+    memset(a, 0, sizeof(lc_arena_t));
+  }
+  return a;
+}
+
+// only once the state has been closed, since this takes the small blocks with it
+void lc_arena_free(lc_arena_t *a) {
+  if (!a) return;
+  page_t *p;
+  while ((p = a->pages)) {
+    a->pages = p->next;
+    free(p);
+  }
+  free(a);
+}
+
+static void *small_alloc(lc_arena_t *a, int c) {
+  block_t *b = a->free[c];
+  if (b) {
+    a->free[c] = b->next;
+    return b;
+  }
+
+  size_t size = class_size[c];
+  if (a->top + size > a->end) {
+    // whatever is left of the old page is too small for this class, and stays unused
+    page_t *p = malloc(ARENA_PAGE);
+    if (!p) return NULL;
+    p->next = a->pages;
+    a->pages = p;
+    a->top = (char *) (p + 1);
+    a->end = (char *) p + ARENA_PAGE;
+  }
+  void *ptr = a->top;
+  a->top += size;
+  return ptr;
+}
+
+static inline void small_free(lc_arena_t *a, void *ptr, int c) {
+  block_t *b = (block_t *) ptr;
+  b->next = a->free[c];
+  a->free[c] = b;
+}
+
+static inline size_t large_size(size_t size) {
+  return size < LARGE_MIN ? LARGE_MIN : size;
+}
+
+static void *block_alloc(lc_arena_t *a, size_t size) {
+  return size <= ARENA_SMALL ? small_alloc(a, size_class(size)) : malloc(large_size(size));
+}
+
+static void block_free(lc_arena_t *a, void *ptr, size_t size) {
+  if (size <= ARENA_SMALL) {
+    small_free(a, ptr, size_class(size));
+  } else {
+    free(ptr);
+  }
+}
+
+/*
+ * Shrinks a large block to a small one when there is no page to move it to, by making it
+ * a page of its own with the data moved up past the header. Lua frees it as a small block
+ * from then on, and the arena frees the page with the others.
+ */
+static void *large_to_page(lc_arena_t *a, void *ptr, size_t nsize) {
+  page_t *p = (page_t *) ptr;
+  memmove(p + 1, ptr, nsize);
+  p->next = a->pages;
+  a->pages = p;
+  return p + 1;
+}
+
+/*
+ * lua_Alloc for states created with lua_newstate(lc_arena_alloc, arena). Lua always tells
+ * us the size of the block it is handing back, so blocks carry no header.
+ */
+void *lc_arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
+  lc_arena_t *a = (lc_arena_t *) ud;
+  if (!ptr) osize = 0;
+
+  if (nsize == 0) {
+    if (ptr) {
+      block_free(a, ptr, osize);
+      a->live -= osize;
+    }
+    return NULL;
+  }
+
+  if (nsize > osize && a->limit && a->live + (nsize - osize) > a->limit) {
+    return NULL;
+  }
+
+  void *p = NULL;
+  if (ptr && osize <= ARENA_SMALL && nsize <= ARENA_SMALL
+      && size_class(osize) == size_class(nsize)) {
+    p = ptr;
+  } else if (ptr && osize > ARENA_SMALL && nsize > ARENA_SMALL) {
+    p = realloc(ptr, large_size(nsize));
+  } else if ((p = block_alloc(a, nsize)) && ptr) {
+    memcpy(p, ptr, osize < nsize ? osize : nsize);
+    block_free(a, ptr, osize);
+  }
+
+  if (!p) {
+    // Lua doesn't expect a shrink to fail. The old block is big enough anyway, but a large
+    // one can't go on the small free lists as it is
+    if (nsize > osize) return NULL;
+    p = osize > ARENA_SMALL && nsize <= ARENA_SMALL ? large_to_page(a, ptr, nsize) : ptr;
+  }
+
+  a->live += nsize - osize;
+  if (a->live > a->peak) a->peak = a->live;
+  return p;
+}
+
+// a limit of zero means the arena may grow without bound
+int lc_arena_set_limit(lc_arena_t *a, size_t limit) {
+  if (!a) return ERR_INVAL;
+  a->limit = limit;
+  return SUCCESS;
+}
+
+size_t lc_arena_limit(lc_arena_t *a) {
+  return a ? a->limit : 0;
+}
+
+size_t lc_arena_live(lc_arena_t *a) {
+  return a ? a->live : 0;
+}
+
+size_t lc_arena_peak(lc_arena_t *a) {
+  return a ? a->peak : 0;
+}
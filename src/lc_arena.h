@@ -0,0 +1,31 @@
+#ifndef __LC_ARENA_H__
+#define __LC_ARENA_H__
+
+#include <stddef.h>
+#include "lc_error.h"
+
+/*
+ * A Lua allocator that owns all the memory of one state. Small blocks come from per size
+ * class free lists carved out of pages owned by the arena, larger ones straight from
+ * malloc. Only the thread currently running the state ever allocates from its arena, so
+ * there is no locking; which thread that is doesn't matter.
+ *
+ * The arena counts the bytes Lua has live, and refuses to grow past its limit (if it has
+ * one), which Lua reports as a memory error in the code that asked for it.
+ */
+#define ARENA_PAGE        (64 * 1024)
+#define ARENA_SMALL       512
+#define ARENA_CLASSES     16
+
+typedef struct _lc_arena lc_arena_t;
+
+lc_arena_t *lc_arena_new( );
+void lc_arena_free(lc_arena_t *a);
+void *lc_arena_alloc(void *ud, void *ptr, size_t osize, size_t nsize);
+
+int lc_arena_set_limit(lc_arena_t *a, size_t limit);
+size_t lc_arena_limit(lc_arena_t *a);
+size_t lc_arena_live(lc_arena_t *a);
+size_t lc_arena_peak(lc_arena_t *a);
+
+#endif // __LC_ARENA_H__
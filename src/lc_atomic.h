@@ -0,0 +1,155 @@
+#ifndef __LC_ATOMIC_H__
+#define __LC_ATOMIC_H__
+
+/*
+ * Inline atomic operations with explicit memory ordering, following the C11 memory model.
+ *
+ * The plain atomic_int_* and atomic_ptr_* calls are sequentially consistent, and are what
+ * anything relying on a store being seen before a later load (the event count and lock
+ * handshakes) must use. The _acquire, _release and _relaxed variants are for paths that
+ * only need the weaker ordering - reference counts, flags published under a lock, and
+ * statistics.
+ */
+
+#include <stdint.h>
+
+#define LC_RELAXED  __ATOMIC_RELAXED
+#define LC_ACQUIRE  __ATOMIC_ACQUIRE
+#define LC_RELEASE  __ATOMIC_RELEASE
+#define LC_ACQ_REL  __ATOMIC_ACQ_REL
+#define LC_SEQ_CST  __ATOMIC_SEQ_CST
+
+static inline void *atomic_ptr_get(volatile void *addr) {
+  return __atomic_load_n((void * volatile *) addr, LC_SEQ_CST);
+}
+
+static inline void *atomic_ptr_get_acquire(volatile void *addr) {
+  return __atomic_load_n((void * volatile *) addr, LC_ACQUIRE);
+}
+
+static inline void atomic_ptr_set(volatile void *addr, void *p) {
+  __atomic_store_n((void * volatile *) addr, p, LC_SEQ_CST);
+}
+
+static inline void atomic_ptr_set_release(volatile void *addr, void *p) {
+  __atomic_store_n((void * volatile *) addr, p, LC_RELEASE);
+}
+
+static inline int atomic_ptr_cas(volatile void *addr, void *o, void *n) {
+  return __atomic_compare_exchange_n((void * volatile *) addr, &o, n, 0, LC_SEQ_CST,
+                                     LC_SEQ_CST);
+}
+
+static inline int atomic_int_get(volatile int *addr) {
+  return __atomic_load_n(addr, LC_SEQ_CST);
+}
+
+static inline int atomic_int_get_acquire(volatile int *addr) {
+  return __atomic_load_n(addr, LC_ACQUIRE);
+}
+
+static inline int atomic_int_get_relaxed(volatile int *addr) {
+  return __atomic_load_n(addr, LC_RELAXED);
+}
+
+static inline void atomic_int_set(volatile int *addr, int i) {
+  __atomic_store_n(addr, i, LC_SEQ_CST);
+}
+
+static inline void atomic_int_set_release(volatile int *addr, int i) {
+  __atomic_store_n(addr, i, LC_RELEASE);
+}
+
+static inline void atomic_int_set_relaxed(volatile int *addr, int i) {
+  __atomic_store_n(addr, i, LC_RELAXED);
+}
+
+static inline int atomic_int_cas(volatile int *addr, int o, int n) {
+  return __atomic_compare_exchange_n(addr, &o, n, 0, LC_SEQ_CST, LC_SEQ_CST);
+}
+
+static inline int atomic_int_cas_acquire(volatile int *addr, int o, int n) {
+  return __atomic_compare_exchange_n(addr, &o, n, 0, LC_ACQUIRE, LC_RELAXED);
+}
+
+static inline int atomic_int_tas(volatile int *addr, int n) {
+  return __atomic_exchange_n(addr, n, LC_ACQUIRE);
+}
+
+static inline int atomic_int_swap(volatile int *addr, int n) {
+  return __atomic_exchange_n(addr, n, LC_SEQ_CST);
+}
+
+static inline int atomic_int_swap_release(volatile int *addr, int n) {
+  return __atomic_exchange_n(addr, n, LC_RELEASE);
+}
+
+static inline int atomic_int_add(volatile int *addr, int i) {
+  return __atomic_add_fetch(addr, i, LC_SEQ_CST);
+}
+
+static inline int atomic_int_add_relaxed(volatile int *addr, int i) {
+  return __atomic_add_fetch(addr, i, LC_RELAXED);
+}
+
+static inline int atomic_int_sub(volatile int *addr, int i) {
+  return __atomic_sub_fetch(addr, i, LC_SEQ_CST);
+}
+
+static inline int atomic_int_inc(volatile int *addr) {
+  return atomic_int_add(addr, 1);
+}
+
+static inline int atomic_int_dec(volatile int *addr) {
+  return atomic_int_sub(addr, 1);
+}
+
+static inline uint64_t atomic_u64_get_acquire(volatile uint64_t *addr) {
+  return __atomic_load_n(addr, LC_ACQUIRE);
+}
+
+static inline void atomic_u64_set_release(volatile uint64_t *addr, uint64_t v) {
+  __atomic_store_n(addr, v, LC_RELEASE);
+}
+
+static inline int atomic_u64_cas(volatile uint64_t *addr, uint64_t o, uint64_t n) {
+  return __atomic_compare_exchange_n(addr, &o, n, 0, LC_ACQ_REL, LC_ACQUIRE);
+}
+
+static inline uint64_t atomic_u64_inc(volatile uint64_t *addr) {
+  return __atomic_add_fetch(addr, 1, LC_RELAXED);
+}
+
+static inline void atomic_fence( ) {
+  __atomic_thread_fence(LC_SEQ_CST);
+}
+
+// for spin loops, tells the CPU we're waiting on another thread
+static inline void cpu_relax( ) {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+  __asm__ __volatile__("yield" ::: "memory");
+#else
+  atomic_fence();
+#endif
+}
+
+/*
+ * Reference counts: taking a reference needs no ordering, since the caller already holds
+ * one (or the registry lock). Dropping one releases our writes to whoever drops the last
+ * reference, and that thread acquires them before it destroys the object.
+ */
+static inline int atomic_ref_inc(volatile int *addr) {
+  return __atomic_add_fetch(addr, 1, LC_RELAXED);
+}
+
+static inline int atomic_ref_dec(volatile int *addr) {
+  int refs = __atomic_sub_fetch(addr, 1, LC_RELEASE);
+  if (refs == 0) {
+    __atomic_thread_fence(LC_ACQUIRE);
+  }
+  return refs;
+}
+
+#endif // __LC_ATOMIC_H__
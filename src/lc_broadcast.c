@@ -0,0 +1,707 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "casting.h"
+#include "lc_thread.h"
+#include "lc_broadcast.h"
+#include "queue.h"
+#include "message.h"
+#include "lc_session.h"
+
+static lc_handles_t *broadcasts;
+
+typedef enum {
+  broadcast_open = 1, broadcast_closed
+} broadcast_status;
+
+/*
+ * Messages from tail up to head are in the ring, message n in slot n % capacity. The ring
+ * holds a reference to each of them, and subscribers take one of their own as they read.
+ * Slots are only let go of when a writer needs them, so tail can be behind every cursor.
+ */
+struct _broadcast {
+  broadcast_id id;
+  lc_spin_t *lock;
+  broadcast_status status;
+  broadcast_policy_t policy;
+  int capacity;
+  message_t **slots;
+  uint64_t head;
+  uint64_t tail;
+  subscriber_t *subs;
+  int count;
+  queue_t *readers;
+  queue_t *writers;
+};
+
+struct _subscriber {
+  broadcast_t *b;
+  uint64_t cursor;     // the next message to read
+  uint64_t missed;     // how many messages were dropped before it got to them
+  int lagged;          // cut off for falling too far behind
+  int waiting;         // has a reader parked
+  subscriber_t *prev;
+  subscriber_t *next;
+};
+
+/*
+ * A reader parked on its subscriber, or a writer parked on the broadcast. Once served,
+ * they are strung together and called back after the lock has been let go of.
+ */
+typedef struct _waiter {
+  channel_callback cb;
+  void *data;
+  subscriber_t *sub;       // NULL for a writer
+  message_t *message;
+  channel_status_t event;
+  struct _waiter *next;
+} waiter_t;
+
+static int dup_waiter(const void *a, void **d) {
+  waiter_t *w = lc_alloc(sizeof(waiter_t));
+  if (w) {
+    memcpy(w, a, sizeof(waiter_t));
+  }
+  *d = w;
+  return w ? SUCCESS : ERR_NOMEM;
+}
+
+static void rel_waiter(void *d) {
+  waiter_t *w = (waiter_t *) d;
+  if (w->message) msg_destroy(w->message);
+  lc_free(w);
+}
+
+static void waiter_done(waiter_t **done, waiter_t *w, message_t *m, channel_status_t event) {
+  w->message = m;
+  w->event = event;
+  w->next = *done;
+  *done = w;
+}
+
+static void waiter_notify(waiter_t *done) {
+  while (done) {
+    waiter_t *w = done;
+    done = w->next;
+    w->cb(w->message, w->data, w->event);
+    lc_free(w);
+  }
+}
+
+// lets go of the messages before pos
+static void release_slots(broadcast_t *b, uint64_t pos) {
+  for (; b->tail < pos; b->tail++) {
+    message_t **slot = &b->slots[b->tail % b->capacity];
+    msg_destroy(*slot);
+    *slot = NULL;
+  }
+}
+
+// the lowest cursor of the subscribers still keeping up
+static uint64_t lowest_cursor(broadcast_t *b) {
+  uint64_t low = b->head;
+  for (subscriber_t *s = b->subs; s; s = s->next) {
+    if (!s->lagged && s->cursor < low) low = s->cursor;
+  }
+  return low;
+}
+
+// makes room for one more message if the policy allows, returning whether there is
+static int make_room(broadcast_t *b) {
+  if (b->head - b->tail < (uint64_t) b->capacity) return 1;
+
+  switch (b->policy) {
+    case BROADCAST_DROP:
+      // whoever hasn't read the oldest message yet finds out it was missed when they do
+      release_slots(b, b->tail + 1);
+      return 1;
+    case BROADCAST_LAG:
+      for (subscriber_t *s = b->subs; s; s = s->next) {
+        if (!s->lagged && s->cursor == b->tail) s->lagged = 1;
+      }
+      break;
+    case BROADCAST_BLOCK:
+      break;
+  }
+  release_slots(b, lowest_cursor(b));
+  return b->head - b->tail < (uint64_t) b->capacity;
+}
+
+// puts m in the ring, and hands it straight to the parked readers (which are all at head)
+static void publish(broadcast_t *b, message_t *m, waiter_t **done) {
+  b->slots[b->head % b->capacity] = m;
+  b->head++;
+
+  waiter_t *w;
+  while ((w = queue_pop(b->readers))) {
+    w->sub->cursor = b->head;
+    w->sub->waiting = 0;
+    waiter_done(done, w, msg_ref(m), read);
+  }
+}
+
+// writes what the parked writers have, for as long as there is room
+static void drain_writers(broadcast_t *b, waiter_t **done) {
+  while (!queue_isempty(b->writers) && make_room(b)) {
+    waiter_t *w = queue_pop(b->writers);
+    publish(b, w->message, done);
+    waiter_done(done, w, NULL, write);
+  }
+}
+
+// called by the handle table once the last reference to the broadcast has gone
+static void broadcast_destroy(void *d) {
+  broadcast_t *b = (broadcast_t *) d;
+  if (b->slots) release_slots(b, b->head);
+  queue_free(b->readers);
+  queue_free(b->writers);
+  lc_spin_destroy(b->lock);
+  lc_free(b->slots);
+  lc_free(b);
+}
+
+static broadcast_t *broadcast_ref(broadcast_id bid) {
+  return lc_handle_ref(broadcasts, bid);
+}
+
+static void broadcast_free(broadcast_t *b) {
+  if (b) lc_handle_release(broadcasts, b->id);
+}
+
+broadcast_t *broadcast_new(int size, broadcast_policy_t policy) {
+  if (size <= 0) return NULL;
+
+  broadcast_t *b = lc_alloc(sizeof(broadcast_t));
+  if (!b) return NULL;
+
+  memset(b, 0, sizeof(broadcast_t));
+  b->status = broadcast_open;
+  b->policy = policy;
+  b->capacity = size;
+  b->readers = queue_new(dup_waiter, rel_waiter);
+  b->writers = queue_new(dup_waiter, rel_waiter);
+  b->lock = lc_spin_new();
+  b->slots = lc_alloc(sizeof(message_t *) * size);
+  if (!b->slots) {
+    broadcast_destroy(b);
+    return NULL;
+  }
+  memset(b->slots, 0, sizeof(message_t *) * size);
+
+  b->id = lc_handle_new(broadcasts, b);
+  if (b->id == HANDLE_NONE) {
+    broadcast_destroy(b);
+    return NULL;
+  }
+  return b;
+}
+
+/*
+ * Parked readers are told the broadcast has closed and parked writers get their messages
+ * back, but subscribers can still read what is left in the ring.
+ */
+int broadcast_close(broadcast_t *b) {
+  if (!b) return ERR_INVAL;
+
+  waiter_t *done = NULL;
+  waiter_t *w;
+  lc_spin_lock(b->lock);
+  if (b->status == broadcast_open) {
+    b->status = broadcast_closed;
+    while ((w = queue_pop(b->readers))) {
+      w->sub->waiting = 0;
+      waiter_done(&done, w, NULL, closed);
+    }
+    while ((w = queue_pop(b->writers))) {
+      waiter_done(&done, w, w->message, closed);
+    }
+  }
+  lc_spin_unlock(b->lock);
+
+  waiter_notify(done);
+  return SUCCESS;
+}
+
+/*
+ * Writes m, which belongs to the broadcast from then on. It returns ERR_FULL if the writer
+ * has to wait for room, and the callback is called once m has been written.
+ */
+int broadcast_write(broadcast_t *b, message_t *m, channel_callback cb, void *data) {
+  if (!b || !m) return ERR_INVAL;
+
+  waiter_t *done = NULL;
+  int rc = SUCCESS;
+
+  lc_spin_lock(b->lock);
+  if (b->status == broadcast_closed) {
+    rc = ERR_CLOSED;
+  } else if (!queue_isempty(b->writers) || !make_room(b)) {
+    waiter_t tmp = { cb, data, NULL, m, write, NULL };
+    queue_push(b->writers, &tmp);
+    rc = ERR_FULL;
+  } else {
+    publish(b, m, &done);
+  }
+  lc_spin_unlock(b->lock);
+
+  if (rc == SUCCESS) {
+    cb(NULL, data, write);
+  }
+  waiter_notify(done);
+  return rc;
+}
+
+// a new subscriber gets the messages written from now on
+subscriber_t *broadcast_subscribe(broadcast_id bid) {
+  broadcast_t *b = broadcast_ref(bid);
+  if (!b) return NULL;
+
+  subscriber_t *s = lc_alloc(sizeof(subscriber_t));
+  if (!s) {
+    broadcast_free(b);
+    return NULL;
+  }
+  memset(s, 0, sizeof(subscriber_t));
+  s->b = b;
+
+  lc_spin_lock(b->lock);
+  s->cursor = b->head;
+  s->next = b->subs;
+  if (b->subs) b->subs->prev = s;
+  b->subs = s;
+  b->count++;
+  lc_spin_unlock(b->lock);
+  return s;
+}
+
+/*
+ * Reads the subscriber's next message, or parks the reader until there is one. It returns
+ * ERR_CLOSED once the broadcast is closed and the subscriber has read everything, and
+ * ERR_OVERFLOW once the subscriber has been cut off for lagging.
+ */
+int subscriber_read(subscriber_t *s, channel_callback cb, void *data) {
+  if (!s) return ERR_INVAL;
+
+  broadcast_t *b = s->b;
+  message_t *m = NULL;
+  waiter_t *done = NULL;
+  int rc = SUCCESS;
+
+  lc_spin_lock(b->lock);
+  if (s->lagged) {
+    rc = ERR_OVERFLOW;
+  } else {
+    if (s->cursor < b->tail) {
+      s->missed += b->tail - s->cursor;
+      s->cursor = b->tail;
+    }
+    if (s->cursor < b->head) {
+      m = msg_ref(b->slots[s->cursor % b->capacity]);
+      s->cursor++;
+      drain_writers(b, &done);
+    } else if (b->status == broadcast_closed) {
+      rc = ERR_CLOSED;
+    } else if (s->waiting) {
+      rc = ERR_BUSY;
+    } else {
+      waiter_t tmp = { cb, data, s, NULL, read, NULL };
+      queue_push(b->readers, &tmp);
+      s->waiting = 1;
+      rc = ERR_EMPTY;
+    }
+  }
+  lc_spin_unlock(b->lock);
+
+  if (m) {
+    cb(m, data, read);
+  }
+  waiter_notify(done);
+  return rc;
+}
+
+static int match_subscriber(const void *p, const void *key) {
+  return ((const waiter_t *) p)->sub != key;
+}
+
+// the subscriber is gone once this returns, and no longer holds back any writers
+void subscriber_close(subscriber_t *s) {
+  if (!s) return;
+
+  broadcast_t *b = s->b;
+  waiter_t *done = NULL;
+
+  lc_spin_lock(b->lock);
+  if (s->waiting) {
+    waiter_t *w = queue_remove(b->readers, match_subscriber, s);
+    if (w) waiter_done(&done, w, NULL, closed);
+  }
+  if (s->prev) s->prev->next = s->next;
+  else b->subs = s->next;
+  if (s->next) s->next->prev = s->prev;
+  b->count--;
+  drain_writers(b, &done);
+  lc_spin_unlock(b->lock);
+
+  waiter_notify(done);
+  broadcast_free(b);
+  lc_free(s);
+}
+
+/*
+ * Callers that aren't tasks wait on their thread's event, as they do for a channel, and
+ * decode what they were handed once they wake.
+ */
+typedef struct _broadcast_wait {
+  lc_event_t *ev;
+  message_t *m;
+  channel_status_t event;
+  volatile int done;
+} broadcast_wait_t;
+
+static void wait_callback(message_t *m, void *data, channel_status_t event) {
+  broadcast_wait_t *w = (broadcast_wait_t *) data;
+  lc_event_t *ev = w->ev;
+  if (event == read) {
+    w->m = m;
+  } else if (m) {
+    msg_destroy(m);
+  }
+  w->event = event;
+  atomic_int_set(&w->done, 1);
+  lc_event_notify(ev);
+}
+
+static void wait_await(broadcast_wait_t *w) {
+  while (!atomic_int_get(&w->done)) {
+    int key = lc_event_prepare(w->ev);
+    if (atomic_int_get(&w->done)) {
+      lc_event_cancel(w->ev);
+      break;
+    }
+    lc_event_wait(w->ev, key, -1);
+  }
+}
+
+static void task_callback(message_t *m, void *data, channel_status_t event) {
+  task_id *ptid = (task_id *) data;
+  message_builder_t mb;
+
+  msg_builder_init(&mb);
+  switch (event) {
+    case read:
+      task_resume(*ptid, m);
+      break;
+    case write:
+      lc_pushboolean(&mb, 1);
+      task_resume(*ptid, msg_new(&mb));
+      break;
+    default:
+      if (m) msg_destroy(m);
+      lc_pushnil(&mb);
+      lc_pushlstring(&mb, "closed", 6);
+      task_resume(*ptid, msg_new(&mb));
+      break;
+  }
+  lc_free(data);
+}
+
+static task_id *task_data(task_id tid) {
+  task_id *ptid = lc_alloc(sizeof(task_id));
+  if (ptid) *ptid = tid;
+  return ptid;
+}
+
+static lua_Broadcast *get_broadcast(lua_State *L, int idx) {
+  return (lua_Broadcast *) luaL_checkudata(L, idx, CASTING_BROADCAST);
+}
+
+static lua_Subscription *get_subscription(lua_State *L, int idx) {
+  return (lua_Subscription *) luaL_checkudata(L, idx, CASTING_SUBSCRIPTION);
+}
+
+static subscriber_t *check_subscriber(lua_State *L, int idx) {
+  lua_Subscription *ls = get_subscription(L, idx);
+  if (!ls->sub) luaL_error(L, "Subscription is closed");
+  return ls->sub;
+}
+
+static int push_broadcast(lua_State *L, broadcast_t *b) {
+  if (!b) return ERR_INVAL;
+
+  lua_Broadcast *lb = (lua_Broadcast *) lua_newuserdata(L, sizeof(lua_Broadcast)); // [ud]
+  lb->bid = b->id;
+  luaL_getmetatable(L, CASTING_BROADCAST); // [ud][meta]
+  lua_setmetatable(L, -2); // [ud]
+  return SUCCESS;
+}
+
+static const char *const policies[] = { "block", "drop", "lag", NULL };
+
+/*
+ * Broadcast.new(size, policy) creates a broadcast that lets subscribers fall up to size
+ * messages behind, after which it will "block" the writers (the default), "drop" the oldest
+ * messages, or cut off the subscribers that "lag".
+ */
+static int luaB_new(lua_State *L) {
+  int size = luaL_checkint(L, 1);
+  int policy = luaL_checkoption(L, 2, "block", policies);
+  luaL_argcheck(L, size > 0, 1, "broadcasts need a buffer");
+
+  broadcast_t *b = broadcast_new(size, policy);
+  if (!b) return luaL_error(L, "Unable to create new broadcast");
+  push_broadcast(L, b);
+  return 1;
+}
+
+// broadcast:write(...) encodes the values once for all the subscribers
+static int luab_write(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  broadcast_t *b = broadcast_ref(lb->bid);
+  if (!b) {
+    return luaL_error(L, "Invalid broadcast");
+  }
+
+  task_id tid = task_current();
+  task_id *ptid = NULL;
+  if (tid && !(ptid = task_data(tid))) {
+    broadcast_free(b);
+    return luaL_error(L, "Unable to write. Insufficient memory ?");
+  }
+  message_t *m = lua_newmessage(L, lua_gettop(L) - 1);
+  if (!m) {
+    lc_free(ptid);
+    broadcast_free(b);
+    return luaL_error(L, "Unable to write. Insufficient memory ?");
+  }
+
+  // a closed broadcast is left to broadcast_write, which checks it under the lock
+  int rc;
+  if (tid) {
+    rc = broadcast_write(b, m, task_callback, ptid);
+    broadcast_free(b);
+    if (rc == SUCCESS || rc == ERR_FULL) return task_yield(tid);
+    lc_free(ptid);
+  } else {
+    broadcast_wait_t w = { lc_event_local(), NULL, write, 0 };
+    rc = broadcast_write(b, m, wait_callback, &w);
+    broadcast_free(b);
+    if (rc == ERR_FULL) wait_await(&w);
+    if (rc == SUCCESS || (rc == ERR_FULL && w.event == write)) {
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+  // closed, before or while waiting
+  if (rc != ERR_FULL) msg_destroy(m);
+  lua_pushnil(L);
+  lua_pushstring(L, "closed");
+  return 2;
+}
+
+// broadcast:subscribe() returns a subscription to the messages written from now on
+static int luab_subscribe(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  subscriber_t *s = broadcast_subscribe(lb->bid);
+  if (!s) return luaL_error(L, "Unable to subscribe to broadcast");
+
+  lua_Subscription *ls = (lua_Subscription *) lua_newuserdata(L, sizeof(lua_Subscription));
+  ls->sub = s;
+  luaL_getmetatable(L, CASTING_SUBSCRIPTION); // [ud][meta]
+  lua_setmetatable(L, -2); // [ud]
+  return 1;
+}
+
+static int luab_close(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  broadcast_t *b = broadcast_ref(lb->bid);
+  if (b) {
+    broadcast_close(b);
+    broadcast_free(b);
+  }
+  lua_pushboolean(L, 1);
+  return 1;
+}
+
+static int luab_status(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  broadcast_t *b = broadcast_ref(lb->bid);
+  if (b) {
+    lc_spin_lock(b->lock);
+    int open = b->status == broadcast_open;
+    lc_spin_unlock(b->lock);
+    lua_pushstring(L, open ? "open" : "closed");
+  } else {
+    lua_pushstring(L, "invalid");
+  }
+  broadcast_free(b);
+  return 1;
+}
+
+// #broadcast is the number of subscribers
+static int luab_size(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  broadcast_t *b = broadcast_ref(lb->bid);
+  int count = 0;
+  if (b) {
+    lc_spin_lock(b->lock);
+    count = b->count;
+    lc_spin_unlock(b->lock);
+  }
+  broadcast_free(b);
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+static int luab_tostring(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  lua_pushfstring(L, CASTING_BROADCAST " <%f>", (lua_Number) lb->bid);
+  return 1;
+}
+
+static int luab_destroy(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  lc_handle_release(broadcasts, lb->bid);
+  return 0;
+}
+
+static int luab_save(lua_State *L) {
+  lua_Broadcast *lb = get_broadcast(L, 1);
+  lua_pushstring(L, CASTING_BROADCAST);
+  lua_pushnumber(L, (lua_Number) lb->bid);
+  return 2;
+}
+
+static int luab_load(lua_State *L) {
+  broadcast_id bid = (broadcast_id) lua_tonumber(L, 1);
+  if (push_broadcast(L, broadcast_ref(bid)) != SUCCESS) {
+    lua_pushnil(L);
+  }
+  return 1;
+}
+
+/*
+ * subscription:read() returns the next message's values, waiting for one if need be. It
+ * returns nil, "closed" once the broadcast has closed and there is nothing left to read,
+ * and nil, "lagged" once the subscription has been cut off.
+ */
+static int luas_read(lua_State *L) {
+  subscriber_t *s = check_subscriber(L, 1);
+  task_id tid = task_current();
+  int rc;
+
+  if (tid) {
+    task_id *ptid = task_data(tid);
+    if (!ptid) {
+      return luaL_error(L, "Unable to read. Insufficient memory ?");
+    }
+    rc = subscriber_read(s, task_callback, ptid);
+    if (rc == SUCCESS || rc == ERR_EMPTY) return task_yield(tid);
+    lc_free(ptid);
+  } else {
+    broadcast_wait_t w = { lc_event_local(), NULL, read, 0 };
+    rc = subscriber_read(s, wait_callback, &w);
+    if (rc == ERR_EMPTY) wait_await(&w);
+    if (w.m) {
+      int count = lua_decodemessage(L, w.m);
+      msg_destroy(w.m);
+      return count;
+    }
+    if (rc == ERR_EMPTY) rc = ERR_CLOSED;
+  }
+
+  if (rc == ERR_BUSY) return luaL_error(L, "Subscription is already being read");
+  lua_pushnil(L);
+  lua_pushstring(L, rc == ERR_OVERFLOW ? "lagged" : "closed");
+  return 2;
+}
+
+// subscription:missed() is how many messages were dropped before it could read them
+static int luas_missed(lua_State *L) {
+  subscriber_t *s = check_subscriber(L, 1);
+  lc_spin_lock(s->b->lock);
+  uint64_t missed = s->missed;
+  if (s->cursor < s->b->tail) missed += s->b->tail - s->cursor;
+  lc_spin_unlock(s->b->lock);
+  lua_pushnumber(L, (lua_Number) missed);
+  return 1;
+}
+
+// #subscription is the number of messages waiting to be read
+static int luas_size(lua_State *L) {
+  subscriber_t *s = check_subscriber(L, 1);
+  lc_spin_lock(s->b->lock);
+  uint64_t from = s->cursor < s->b->tail ? s->b->tail : s->cursor;
+  int count = s->lagged ? 0 : (int) (s->b->head - from);
+  lc_spin_unlock(s->b->lock);
+  lua_pushnumber(L, count);
+  return 1;
+}
+
+static int luas_close(lua_State *L) {
+  lua_Subscription *ls = get_subscription(L, 1);
+  subscriber_close(ls->sub);
+  ls->sub = NULL;
+  return 0;
+}
+
+static int luas_tostring(lua_State *L) {
+  lua_Subscription *ls = get_subscription(L, 1);
+  if (ls->sub) {
+    lua_pushfstring(L, CASTING_SUBSCRIPTION " <%f>", (lua_Number) ls->sub->b->id);
+  } else {
+    lua_pushstring(L, CASTING_SUBSCRIPTION " <closed>");
+  }
+  return 1;
+}
+
+static const luaL_Reg funcs[] = { { "new", luaB_new },
+                                  { NULL, NULL } };
+
+static const luaL_Reg methods[] = { { "__tostring", luab_tostring },
+                                    { "__gc", luab_destroy },
+                                    { "__len", luab_size },
+                                    { "write", luab_write },
+                                    { "subscribe", luab_subscribe },
+                                    { "__save", luab_save },
+                                    { "__load", luab_load },
+                                    { "close", luab_close },
+                                    { "status", luab_status },
+                                    { NULL, NULL } };
+
+static const luaL_Reg sub_methods[] = { { "__tostring", luas_tostring },
+                                        { "__gc", luas_close },
+                                        { "__len", luas_size },
+                                        { "read", luas_read },
+                                        { "missed", luas_missed },
+                                        { "close", luas_close },
+                                        { NULL, NULL } };
+
+void init_broadcast( ) {
+  static int init = 0;
+
+  while (!atomic_int_cas(&init, 1, 1)) {
+    broadcasts = lc_handles_new(broadcast_destroy);
+    INFO("Initialized broadcast");
+    init = 1;
+  }
+}
+
+int lc_open_broadcast(lua_State *L) {
+  init_broadcast();
+  lua_newtable(L); // [tbl]
+  luaL_register(L, NULL, funcs); // [tbl]
+
+  if (luaL_newmetatable(L, CASTING_BROADCAST) == 1) {
+    luaL_register(L, NULL, methods); // [tbl][tbl]
+    lua_setfield(L, -1, "__index");
+  }
+
+  if (luaL_newmetatable(L, CASTING_SUBSCRIPTION) == 1) {
+    luaL_register(L, NULL, sub_methods); // [tbl][tbl]
+    lua_setfield(L, -1, "__index");
+  }
+  return 0;
+}
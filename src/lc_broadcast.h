@@ -0,0 +1,48 @@
+#ifndef __LC_BROADCAST_H__
+#define __LC_BROADCAST_H__
+
+#include "casting.h"
+#include "message.h"
+#include "lc_handle.h"
+#include "lc_channel.h"
+
+#define CASTING_BROADCAST     "casting.broadcast"
+#define CASTING_SUBSCRIPTION  "casting.subscription"
+
+/*
+ * A broadcast hands every message written to it to each of its subscribers. A message is
+ * encoded once and kept in a ring of size slots, and every subscriber reads it from there
+ * through a cursor of its own, taking a reference rather than a copy. The ring is how far
+ * a subscriber can fall behind, and the policy says what happens when one does:
+ *
+ *   BROADCAST_BLOCK  writers wait for the slowest subscriber
+ *   BROADCAST_DROP   writers go on, and the oldest messages are lost to those behind
+ *   BROADCAST_LAG    writers go on, and subscribers size messages behind are cut off
+ */
+typedef enum {
+  BROADCAST_BLOCK = 0, BROADCAST_DROP, BROADCAST_LAG
+} broadcast_policy_t;
+
+typedef struct _broadcast broadcast_t;
+typedef struct _subscriber subscriber_t;
+typedef lc_handle_t broadcast_id;
+
+typedef struct {
+  broadcast_id bid;
+} lua_Broadcast;
+
+typedef struct {
+  subscriber_t *sub;
+} lua_Subscription;
+
+broadcast_t *broadcast_new(int size, broadcast_policy_t policy);
+int broadcast_close(broadcast_t *b);
+int broadcast_write(broadcast_t *b, message_t *m, channel_callback cb, void *data);
+
+subscriber_t *broadcast_subscribe(broadcast_id bid);
+int subscriber_read(subscriber_t *s, channel_callback cb, void *data);
+void subscriber_close(subscriber_t *s);
+
+int lc_open_broadcast(lua_State *L);
+
+#endif // __LC_BROADCAST_H__
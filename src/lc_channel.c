@@ -10,251 +10,806 @@
 #include "lc_thread.h"
 #include "lc_channel.h"
 #include "queue.h"
-#include "map.h"
 #include "message.h"
 #include "lc_session.h"
+#include "lc_timer.h"
+#include "lc_ring.h"
 
-static lc_spin_t *lock;
-static map_t *channels;
+static lc_handles_t *channels;
 
 typedef enum {
   channel_open = 1, channel_closed
 } channel_status;
 
-struct _channel {
-  channel_id id;
-  int ref_count;
-  lc_spin_t *lock;
-  int buf_size;
-  channel_status status;
-  queue_t *messages;
-  queue_t *readers;
-  queue_t *writers;
-};
-
+// a writer starts like a reader, so either can be looked at as a reader_t
 typedef struct _reader {
+  struct _reader *prev;
+  struct _reader *next;
+  struct _reader **owner; // where whoever parked the waiter keeps it, if anywhere
   channel_callback cb;
   void *data;
+  volatile int *claim;  // shared by the waiters of a select, NULL for anyone else
 } reader_t;
 
 typedef struct _writer {
+  struct _reader *prev;
+  struct _reader *next;
+  struct _reader **owner;
   channel_callback cb;
   void *data;
+  volatile int *claim;
   message_t *message;
 } writer_t;
 
-static inline int cmp_channel(const void *p1, const void *p2) {
-  channel_t *a = (channel_t *) p1;
-  channel_t *b = (channel_t *) p2;
+/*
+ * The readers or the writers parked on a channel, in order. They are linked both ways so
+ * that a select or a deadline can take its own waiter back in constant time, through the
+ * pointer the channel keeps in its owner for as long as the waiter is parked.
+ */
+typedef struct _waiters {
+  reader_t *head;
+  reader_t *tail;
+} waiters_t;
+
+struct _channel {
+  channel_id id;
+  lc_spin_t *lock;
+  int buf_size;
+  channel_status status;
+  queue_t *messages;
+  waiters_t readers;
+  waiters_t writers;
+  lc_ring_t *ring;       // buffered channels keep their messages here rather than in messages
+  volatile int waiting;  // readers and writers parked on a buffered channel
+};
 
-  return a->id == b->id ? 0 : a->id > b->id ? 1 : -1;
+static void rel_message(void *d) {
+  message_t *m = (message_t *) d;
+  msg_destroy(m);
 }
 
-static int dup_channel(const void *a, void **n) {
-  channel_t *d = (channel_t *) lc_alloc(sizeof(channel_t));
-  if (d) {
-    memcpy(d, a, sizeof(channel_t));
+// parks a waiter at the end of q, a writer if it has a message. Lock held
+static int waiter_push(waiters_t *q, channel_callback cb, void *data, volatile int *claim,
+    message_t *message, reader_t **owner) {
+  reader_t *r = lc_alloc(message ? sizeof(writer_t) : sizeof(reader_t));
+  if (!r) return ERR_NOMEM;
+
+  r->prev = q->tail;
+  r->next = NULL;
+  r->owner = owner;
+  r->cb = cb;
+  r->data = data;
+  r->claim = claim;
+  if (message) ((writer_t *) r)->message = message;
+
+  if (q->tail) {
+    q->tail->next = r;
+  } else {
+    q->head = r;
   }
-  *n = d;
-  return 0;
+  q->tail = r;
+  if (owner) *owner = r;
+  return SUCCESS;
 }
 
-static void rel_channel(void *d) {
-  lc_free(d);
+// takes r off q, wherever it is on it. Lock held
+static void waiter_unlink(waiters_t *q, reader_t *r) {
+  if (r->prev) {
+    r->prev->next = r->next;
+  } else {
+    q->head = r->next;
+  }
+  if (r->next) {
+    r->next->prev = r->prev;
+  } else {
+    q->tail = r->prev;
+  }
+  if (r->owner) *r->owner = NULL;
+  r->owner = NULL;
 }
 
-static void rel_message(void *d) {
-  message_t *m = (message_t *) d;
-  msg_destroy(m);
+static reader_t *waiter_pop(waiters_t *q) {
+  reader_t *r = q->head;
+  if (r) waiter_unlink(q, r);
+  return r;
 }
 
-static int dup_reader(const void *a, void **d) {
-  reader_t *r = lc_alloc(sizeof(reader_t));
-  if (r) {
-    memcpy(r, a, sizeof(reader_t));
+// empties q, leaving its waiters linked to each other for waiters_close(). Lock held
+static reader_t *waiters_take(waiters_t *q) {
+  reader_t *all = q->head;
+  for (reader_t *r = all; r; r = r->next) {
+    if (r->owner) *r->owner = NULL;
+    r->owner = NULL;
   }
-  *d = r;
-  return SUCCESS;
+  q->head = q->tail = NULL;
+  return all;
 }
 
-static int dup_writer(const void *a, void **d) {
-  writer_t *w = lc_alloc(sizeof(writer_t));
-  if (w) {
-    memcpy(w, a, sizeof(writer_t));
+// tells the waiters taken off a channel that it is closed, and frees them
+static void waiters_close(reader_t *r, int writers) {
+  while (r) {
+    reader_t *next = r->next;
+    r->cb(writers ? ((writer_t *) r)->message : NULL, r->data, closed);
+    lc_free(r);
+    r = next;
   }
-  *d = w;
-  return SUCCESS;
 }
 
-static void rel_reader(void *d) {
-  reader_t *r = (reader_t *) d;
-  r->cb(NULL, r->data, closed);
+/*
+ * The waiters of a select share a claim, so that only one of them is ever served: it is
+ * CLAIM_OPEN while the select waits, CLAIM_BUSY while a channel tries one of its waiters
+ * and CLAIM_DONE once one has been served. A channel holds a waiter's claim while it sees
+ * whether it can serve it. The select takes its other waiters back once it is done, and a
+ * channel that comes to one before then drops it.
+ */
+#define CLAIM_OPEN  0
+#define CLAIM_BUSY  1
+#define CLAIM_DONE  2
+
+// returns 0 if the claim has already been served, anyone without one can always be served
+static int claim_hold(volatile int *claim) {
+  if (!claim) return 1;
+  for (;;) {
+    if (atomic_int_cas(claim, CLAIM_OPEN, CLAIM_BUSY)) return 1;
+    if (atomic_int_get(claim) == CLAIM_DONE) return 0;
+    cpu_relax();
+  }
 }
 
-static void rel_writer(void *d) {
-  writer_t *w = (writer_t *) d;
-  w->cb(w->message, w->data, closed);
+static void claim_release(volatile int *claim, int served) {
+  if (claim) atomic_int_set(claim, served ? CLAIM_DONE : CLAIM_OPEN);
 }
 
-static channel_t *channel_find(channel_id cid) {
-  channel_t f = { cid };
-  lc_spin_lock(lock);
-  channel_t *c = map_find(channels, &f);
-  lc_spin_unlock(lock);
+/*
+ * Holds a waiter's claim along with the caller's own, if it has one. They are taken in
+ * address order like locks, so two channels pairing selects can't wait on each other.
+ * Returns 1 with both held, 0 if the waiter has been served elsewhere and -1 if the caller
+ * has.
+ */
+static int claim_pair(volatile int *own, volatile int *other) {
+  if (!own) return claim_hold(other) ? 1 : 0;
+  if (!other) return claim_hold(own) ? 1 : -1;
+
+  volatile int *first = own < other ? own : other;
+  volatile int *second = own < other ? other : own;
+  if (!claim_hold(first)) return first == own ? -1 : 0;
+  if (!claim_hold(second)) {
+    claim_release(first, 0);
+    return second == own ? -1 : 0;
+  }
+  return 1;
+}
 
-  return c;
+// drops the waiter at the head of q, whose select has been served elsewhere. Lock held
+static void waiter_drop(channel_t *c, waiters_t *q) {
+  reader_t *r = waiter_pop(q);
+  if (c->ring) atomic_int_dec(&c->waiting);
+  r->cb(q == &c->writers ? ((writer_t *) r)->message : NULL, r->data, cancelled);
+  lc_free(r);
 }
 
-static channel_t *channel_ref(channel_id cid) {
-  channel_t f = { cid };
-  lc_spin_lock(lock);
-  channel_t *c = map_find(channels, &f);
-  if (c) {
-    atomic_int_inc(&c->ref_count);
+// the first waiter on q that can still be served, left on q with its claim held. Lock held
+static void *waiter_hold(channel_t *c, waiters_t *q) {
+  reader_t *r;
+  while ((r = q->head)) {
+    if (claim_hold(r->claim)) return r;
+    waiter_drop(c, q);
   }
-  lc_spin_unlock(lock);
+  return NULL;
+}
 
-  return c;
+// takes the first waiter that can still be served off q, for a caller sure to serve it
+static void *waiter_take(channel_t *c, waiters_t *q) {
+  reader_t *r = waiter_hold(c, q);
+  if (r) {
+    waiter_pop(q);
+    claim_release(r->claim, 1);
+  }
+  return r;
 }
 
-static void channel_free(channel_t *c) {
-  do {
-    lc_spin_lock(lock);
+// called by the handle table once the last reference to the channel has gone
+static void channel_destroy(void *d) {
+  channel_t *c = (channel_t *) d;
+  lc_spin_destroy(c->lock);
+  // TODO should each reader/writer be informed of the closure of the channel ??
+  queue_clear(c->messages);
+  waiters_close(waiters_take(&c->readers), 0);
+  waiters_close(waiters_take(&c->writers), 1);
+  lc_ring_free(c->ring, rel_message);
+  lc_free(c);
+}
 
-    if (c) {
-      if (atomic_int_dec(&c->ref_count) > 0) break;
-      map_remove(channels, c);
-      lc_spin_destroy(c->lock);
-      // TODO should each reader/writer be informed of the closure of the channel ??
-      queue_clear(c->messages);
-      queue_clear(c->readers);
-      queue_clear(c->writers);
-      c = lc_free(c);
-    }
-  } while (0);
-  lc_spin_unlock(lock);
+static channel_t *channel_ref(channel_id cid) {
+  return lc_handle_ref(channels, cid);
+}
+
+static void channel_free(channel_t *c) {
+  if (c) lc_handle_release(channels, c->id);
 }
 
 int channel_close(channel_t *c) {
   if (!c) return ERR_INVAL;
 
+  // the waiters are told once the lock is released, as a select told of the close goes
+  // on to take its waiters off other channels, or this one
+  reader_t *readers = NULL, *writers = NULL;
+
   lc_spin_lock(c->lock);
   if (c->status == channel_open) {
     queue_clear(c->messages);
-    queue_clear(c->readers);
-    queue_clear(c->writers);
+    readers = waiters_take(&c->readers);
+    writers = waiters_take(&c->writers);
+    // a reader may still be taking a message from the ring without the lock, so whatever is
+    // left in there goes with the channel
+    if (c->ring) atomic_int_set(&c->waiting, 0);
     c->status = channel_closed;
   }
   lc_spin_unlock(c->lock);
+
+  waiters_close(readers, 0);
+  waiters_close(writers, 1);
   return SUCCESS;
 }
 
-channel_t *channel_new(int size) {
-  static channel_id next_id = 0;
+/*
+ * Creates a channel buffering size messages (unbounded when negative). A CHANNEL_SPSC
+ * channel must have a buffer, and at most one writer and one reader at any time.
+ */
+channel_t *channel_new(int size, int flags) {
+  if ((flags & CHANNEL_SPSC) && size <= 0) return NULL;
 
-  channel_t c = { };
+  channel_t *c = lc_alloc(sizeof(channel_t));
+  if (!c) return NULL;
 
-  c.ref_count = 1;
-  c.buf_size = (size < 0) ? INT_MAX : size;
-  c.status = channel_open;
+  memset(c, 0, sizeof(channel_t));
+  c->buf_size = (size < 0) ? INT_MAX : size;
+  c->status = channel_open;
   // TODO put an appropriate release routine on the queues
-  c.messages = queue_new(NULL, rel_message);
-  c.readers = queue_new(dup_reader, rel_reader);
-  c.writers = queue_new(dup_writer, rel_writer);
-
-  c.lock = lc_spin_new();
-  lc_spin_lock(lock);
-  c.id = ++next_id;
-  map_insert(channels, &c);
-  lc_spin_unlock(lock);
+  c->messages = queue_new(NULL, rel_message);
+  c->lock = lc_spin_new();
+  if (size > 0) {
+    c->ring = lc_ring_new(size, (flags & CHANNEL_SPSC) ? RING_SPSC : 0);
+    if (!c->ring) {
+      channel_destroy(c);
+      return NULL;
+    }
+  }
 
-  return channel_find(c.id);
+  c->id = lc_handle_new(channels, c);
+  if (c->id == HANDLE_NONE) {
+    channel_destroy(c);
+    return NULL;
+  }
+  return c;
 }
 
 int channel_count(channel_id cid) {
   channel_t *c = channel_ref(cid);
   if (!c) return ERR_INVAL;
 
-  lc_spin_lock(c->lock);
-  int count = queue_size(c->messages);
-  lc_spin_unlock(c->lock);
+  int count;
+  if (c->ring) {
+    count = lc_ring_count(c->ring);
+  } else {
+    lc_spin_lock(c->lock);
+    count = queue_size(c->messages);
+    lc_spin_unlock(c->lock);
+  }
 
   channel_free(c);
   return count;
 }
 
-int channel_write(channel_t *c, message_t *message, channel_callback cb, void *data) {
-  if (!c || !message || !cb) return ERR_INVAL;
+/*
+ * Buffered channels pass messages through a lock-free ring. While nobody is parked on the
+ * channel the ring is all there is to it, and reads and writes go straight to it. Once a
+ * reader finds it empty or a writer finds it full, they park under the lock as usual, and
+ * everyone takes the locked path until the parked have been served, which keeps them in
+ * order. Parking and the lock-free operations each check the other side afterwards (with a
+ * fence in between), so whichever comes second sees the first and balances the channel.
+ */
+static void ring_balance(channel_t *c) {
+  for (;;) {
+    reader_t *r = NULL;
+    writer_t *w = NULL;
+    message_t *m = NULL;
+
+    lc_spin_lock(c->lock);
+    if ((r = waiter_hold(c, &c->readers))) {
+      m = lc_ring_pop(c->ring);
+      claim_release(r->claim, m != NULL);
+      if (m) {
+        waiter_pop(&c->readers);
+      } else {
+        r = NULL;
+      }
+    }
+    if (!r && (w = waiter_hold(c, &c->writers))) {
+      int pushed = lc_ring_push(c->ring, w->message) == SUCCESS;
+      claim_release(w->claim, pushed);
+      if (pushed) {
+        waiter_pop(&c->writers);
+      } else {
+        w = NULL;
+      }
+    }
+    if (r || w) atomic_int_dec(&c->waiting);
+    lc_spin_unlock(c->lock);
 
-  if (c->status == channel_closed) return ERR_CLOSED;
+    if (r) {
+      r->cb(m, r->data, read);
+      lc_free(r);
+    } else if (w) {
+      w->cb(w->message, w->data, write);
+      lc_free(w);
+    } else {
+      return;
+    }
+  }
+}
 
-  reader_t *r;
-  writer_t *w = NULL;
-  message_t *m = NULL;
+static int ring_write(channel_t *c, message_t *message, channel_callback cb, void *data,
+    volatile int *claim, int park, reader_t **owner) {
+  if (!claim && !atomic_int_get_acquire(&c->waiting)
+      && lc_ring_push(c->ring, message) == SUCCESS) {
+    atomic_fence();
+    if (atomic_int_get(&c->waiting)) ring_balance(c);
+    cb(message, data, write);
+    return SUCCESS;
+  }
 
   int rc = SUCCESS;
-
   lc_spin_lock(c->lock);
-
-  if (queue_size(c->messages) < c->buf_size) {
-    queue_push(c->messages, message);
+  if (!claim_hold(claim)) {
+    rc = ERR_BUSY;
+  } else if (!c->writers.head && lc_ring_push(c->ring, message) == SUCCESS) {
+    claim_release(claim, 1);
+  } else if (park) {
+    claim_release(claim, 0);
+    rc = waiter_push(&c->writers, cb, data, claim, message, owner);
+    if (rc == SUCCESS) {
+      atomic_int_inc(&c->waiting);
+      rc = ERR_FULL;
+    }
   } else {
-    writer_t tmp = { cb, data, message };
-    queue_push(c->writers, &tmp);
-    rc = ERR_FULL;
-  }
-  r = queue_pop(c->readers);
-  if (r) {
-    m = queue_pop(c->messages);
-    w = queue_pop(c->writers);
+    claim_release(claim, 0);
+    rc = ERR_AGAIN;
   }
   lc_spin_unlock(c->lock);
+  if (rc != SUCCESS && rc != ERR_FULL) return rc;
 
+  atomic_fence();
+  ring_balance(c);
   if (rc == SUCCESS) {
     cb(message, data, write);
   }
+  return rc;
+}
 
-  if (r) {
-    if (!m) m = w->message;
-    r->cb(m, r->data, read);
-    if (w) {
-      w->cb(w->message, w->data, write);
-      lc_free(w);
+static int ring_read(channel_t *c, channel_callback cb, void *data, volatile int *claim,
+    int park, reader_t **owner) {
+  message_t *m = NULL;
+  if (!claim && !atomic_int_get_acquire(&c->waiting) && (m = lc_ring_pop(c->ring))) {
+    atomic_fence();
+    if (atomic_int_get(&c->waiting)) ring_balance(c);
+    cb(m, data, read);
+    return SUCCESS;
+  }
+
+  int rc = SUCCESS;
+  lc_spin_lock(c->lock);
+  if (!claim_hold(claim)) {
+    rc = ERR_BUSY;
+  } else if (!c->readers.head && (m = lc_ring_pop(c->ring))) {
+    claim_release(claim, 1);
+  } else if (park) {
+    claim_release(claim, 0);
+    rc = waiter_push(&c->readers, cb, data, claim, NULL, owner);
+    if (rc == SUCCESS) {
+      atomic_int_inc(&c->waiting);
+      rc = ERR_EMPTY;
     }
-    lc_free(r);
+  } else {
+    claim_release(claim, 0);
+    rc = ERR_AGAIN;
   }
+  lc_spin_unlock(c->lock);
+  if (rc != SUCCESS && rc != ERR_EMPTY) return rc;
 
+  atomic_fence();
+  ring_balance(c);
+  if (rc == SUCCESS) {
+    cb(m, data, read);
+  }
   return rc;
 }
 
-int channel_read(channel_t *c, channel_callback cb, void *data) {
-  if (!c || !cb) return ERR_INVAL;
+/*
+ * Unbuffered and unbounded channels. Readers only wait while there are no messages, and
+ * writers only wait on an unbuffered channel while there are no readers, so a reader that
+ * turns up is handed the message straight away, and likewise a writer.
+ */
+static int queue_write(channel_t *c, message_t *message, channel_callback cb, void *data,
+    volatile int *claim, int park, reader_t **owner) {
+  reader_t *r;
+  int rc = SUCCESS;
 
-  if (c->status == channel_closed) return ERR_CLOSED;
+  lc_spin_lock(c->lock);
+  while ((r = c->readers.head)) {
+    // a select can't be the reader for its own write
+    if (claim && r->claim == claim) {
+      r = NULL;
+      break;
+    }
+    int held = claim_pair(claim, r->claim);
+    if (held > 0) {
+      waiter_pop(&c->readers);
+      claim_release(r->claim, 1);
+      claim_release(claim, 1);
+      break;
+    }
+    if (held < 0) {
+      lc_spin_unlock(c->lock);
+      return ERR_BUSY;
+    }
+    waiter_drop(c, &c->readers);
+  }
 
-  message_t *m;
-  writer_t *w;
+  if (!r) {
+    if (!claim_hold(claim)) {
+      rc = ERR_BUSY;
+    } else if (queue_size(c->messages) < c->buf_size) {
+      queue_push(c->messages, message);
+      claim_release(claim, 1);
+    } else if (park) {
+      claim_release(claim, 0);
+      rc = waiter_push(&c->writers, cb, data, claim, message, owner);
+      if (rc == SUCCESS) rc = ERR_FULL;
+    } else {
+      claim_release(claim, 0);
+      rc = ERR_AGAIN;
+    }
+  }
+  lc_spin_unlock(c->lock);
+
+  if (rc == SUCCESS) {
+    cb(message, data, write);
+  }
+  if (r) {
+    r->cb(message, r->data, read);
+    lc_free(r);
+  }
+  return rc;
+}
+
+static int queue_read(channel_t *c, channel_callback cb, void *data, volatile int *claim,
+    int park, reader_t **owner) {
+  message_t *m = NULL;
+  writer_t *w = NULL;
   int rc = SUCCESS;
 
   lc_spin_lock(c->lock);
-  m = queue_pop(c->messages);
-  w = queue_pop(c->writers);
-  if (!m && !w) {
-    reader_t r = { cb, data };
-    queue_push(c->readers, &r);
-    rc = ERR_EMPTY;
+  if (!queue_isempty(c->messages)) {
+    if (claim_hold(claim)) {
+      m = queue_pop(c->messages);
+      claim_release(claim, 1);
+    } else {
+      rc = ERR_BUSY;
+    }
+  } else {
+    while ((w = (writer_t *) c->writers.head)) {
+      if (claim && w->claim == claim) {
+        w = NULL;
+        break;
+      }
+      int held = claim_pair(claim, w->claim);
+      if (held > 0) {
+        waiter_pop(&c->writers);
+        claim_release(w->claim, 1);
+        claim_release(claim, 1);
+        m = w->message;
+        break;
+      }
+      if (held < 0) {
+        w = NULL;
+        rc = ERR_BUSY;
+        break;
+      }
+      waiter_drop(c, &c->writers);
+    }
+
+    if (!m && rc == SUCCESS) {
+      if (claim_hold(claim)) {
+        claim_release(claim, 0);
+        if (park) {
+          rc = waiter_push(&c->readers, cb, data, claim, NULL, owner);
+          if (rc == SUCCESS) rc = ERR_EMPTY;
+        } else {
+          rc = ERR_AGAIN;
+        }
+      } else {
+        rc = ERR_BUSY;
+      }
+    }
   }
   lc_spin_unlock(c->lock);
 
-  if (rc == SUCCESS) {
-    if (!m) m = w->message;
+  if (m) {
     cb(m, data, read);
     if (w) {
       w->cb(m, w->data, write);
       lc_free(w);
     }
   }
+  return rc;
+}
 
+/*
+ * Writes and reads that a select or a deadline makes. A select's return ERR_BUSY, without
+ * doing anything, once the select has been served by another case. Unless told to park,
+ * they return ERR_AGAIN instead of waiting, and the message and callback are left with the
+ * caller. A waiter that is parked is kept in *owner, if given, for as long as it is.
+ */
+static int channel_write_claim(channel_t *c, message_t *message, channel_callback cb,
+    void *data, volatile int *claim, int park, reader_t **owner) {
+  if (!c || !message || !cb) return ERR_INVAL;
+
+  if (c->status == channel_closed) return ERR_CLOSED;
+  if (c->ring) return ring_write(c, message, cb, data, claim, park, owner);
+  return queue_write(c, message, cb, data, claim, park, owner);
+}
+
+static int channel_read_claim(channel_t *c, channel_callback cb, void *data,
+    volatile int *claim, int park, reader_t **owner) {
+  if (!c || !cb) return ERR_INVAL;
+
+  if (c->status == channel_closed) return ERR_CLOSED;
+  if (c->ring) return ring_read(c, cb, data, claim, park, owner);
+  return queue_read(c, cb, data, claim, park, owner);
+}
+
+int channel_write(channel_t *c, message_t *message, channel_callback cb, void *data) {
+  return channel_write_claim(c, message, cb, data, NULL, 1, NULL);
+}
+
+int channel_read(channel_t *c, channel_callback cb, void *data) {
+  return channel_read_claim(c, cb, data, NULL, 1, NULL);
+}
+
+// stands in for the writer of all but the last message of a batch that had to wait
+static void batch_written(message_t *m, void *data, channel_status_t event) {
+  if (event != write && m) msg_destroy(m);
+}
+
+/*
+ * Parks the messages a batch couldn't write straight away, in order, so that the writer is
+ * called back once, when the last of them is taken. Must be called with the channel locked.
+ */
+static void park_batch(channel_t *c, message_t **ms, int count, channel_callback cb, void *data) {
+  for (int i = 0; i < count; i++) {
+    int last = i == count - 1;
+    waiter_push(&c->writers, last ? cb : batch_written, last ? data : NULL, NULL, ms[i], NULL);
+    if (c->ring) atomic_int_inc(&c->waiting);
+  }
+}
+
+static int ring_write_many(channel_t *c, message_t **ms, int count, channel_callback cb,
+    void *data) {
+  int i = 0;
+  if (!atomic_int_get_acquire(&c->waiting)) {
+    while (i < count && lc_ring_push(c->ring, ms[i]) == SUCCESS) i++;
+    atomic_fence();
+    if (atomic_int_get(&c->waiting)) ring_balance(c);
+  }
+
+  if (i < count) {
+    lc_spin_lock(c->lock);
+    if (!c->writers.head) {
+      while (i < count && lc_ring_push(c->ring, ms[i]) == SUCCESS) i++;
+    }
+    int parked = i < count;
+    if (parked) park_batch(c, ms + i, count - i, cb, data);
+    lc_spin_unlock(c->lock);
+
+    atomic_fence();
+    ring_balance(c);
+    if (parked) return ERR_FULL;
+  }
+
+  cb(NULL, data, write);
+  return SUCCESS;
+}
+
+static int queue_write_many(channel_t *c, message_t **ms, int count, channel_callback cb,
+    void *data) {
+  reader_t *rs[CHANNEL_BATCH_MAX];
+  int i = 0;
+
+  lc_spin_lock(c->lock);
+  while (i < count && (rs[i] = waiter_take(c, &c->readers))) i++;
+  int served = i;
+  while (i < count && queue_size(c->messages) < c->buf_size) {
+    queue_push(c->messages, ms[i++]);
+  }
+  int parked = i < count;
+  if (parked) park_batch(c, ms + i, count - i, cb, data);
+  lc_spin_unlock(c->lock);
+
+  for (i = 0; i < served; i++) {
+    rs[i]->cb(ms[i], rs[i]->data, read);
+    lc_free(rs[i]);
+  }
+  if (parked) return ERR_FULL;
+
+  cb(NULL, data, write);
+  return SUCCESS;
+}
+
+/*
+ * Writes count messages (at most CHANNEL_BATCH_MAX) in order, taking the channel lock once
+ * for the lot. The callback gets a single write event once all of them are in, which is
+ * straight away unless this returns ERR_FULL.
+ */
+int channel_write_many(channel_t *c, message_t **ms, int count, channel_callback cb,
+    void *data) {
+  if (!c || !ms || count <= 0 || count > CHANNEL_BATCH_MAX || !cb) return ERR_INVAL;
+
+  if (c->status == channel_closed) return ERR_CLOSED;
+  if (c->ring) return ring_write_many(c, ms, count, cb, data);
+  return queue_write_many(c, ms, count, cb, data);
+}
+
+static int ring_take(channel_t *c, message_t **ms, int max) {
+  int n = 0;
+  if (!atomic_int_get_acquire(&c->waiting)) {
+    while (n < max && (ms[n] = lc_ring_pop(c->ring))) n++;
+    atomic_fence();
+    if (atomic_int_get(&c->waiting)) ring_balance(c);
+    return n;
+  }
+
+  lc_spin_lock(c->lock);
+  if (!c->readers.head) {
+    while (n < max && (ms[n] = lc_ring_pop(c->ring))) n++;
+  }
+  lc_spin_unlock(c->lock);
+
+  // parked writers move up into the room just made
+  atomic_fence();
+  ring_balance(c);
+  return n;
+}
+
+static int queue_take(channel_t *c, message_t **ms, int max) {
+  writer_t *ws[CHANNEL_BATCH_MAX];
+  int n = 0, taken = 0;
+
+  lc_spin_lock(c->lock);
+  while (n < max) {
+    message_t *m = queue_pop(c->messages);
+    if (!m) {
+      writer_t *w = waiter_take(c, &c->writers);
+      if (!w) break;
+      ws[taken++] = w;
+      m = w->message;
+    }
+    ms[n++] = m;
+  }
+  lc_spin_unlock(c->lock);
+
+  for (int i = 0; i < taken; i++) {
+    ws[i]->cb(ws[i]->message, ws[i]->data, write);
+    lc_free(ws[i]);
+  }
+  return n;
+}
+
+/*
+ * Takes up to max messages (at most CHANNEL_BATCH_MAX) that are ready to be read, without
+ * waiting for any, and returns how many it took.
+ */
+int channel_take(channel_t *c, message_t **ms, int max) {
+  if (!c || !ms || max <= 0 || max > CHANNEL_BATCH_MAX) return ERR_INVAL;
+
+  if (c->status == channel_closed) return ERR_CLOSED;
+  if (c->ring) return ring_take(c, ms, max);
+  return queue_take(c, ms, max);
+}
+
+// takes a waiter back off its channel for whoever parked it, if it is still parked
+static reader_t *waiter_cancel(channel_id cid, reader_t **owner, int writer) {
+  reader_t *r = NULL;
+  channel_t *c = channel_ref(cid);
+  if (c) {
+    lc_spin_lock(c->lock);
+    if ((r = *owner)) {
+      waiter_unlink(writer ? &c->writers : &c->readers, r);
+      if (c->ring) atomic_int_dec(&c->waiting);
+    }
+    lc_spin_unlock(c->lock);
+    channel_free(c);
+  }
+  return r;
+}
+
+/*
+ * A read or write with a deadline. Its waiter is queued on the channel like any other, and
+ * a timer takes it off again if it is still there once the deadline has passed; the channel
+ * lock decides which of the two gets to it first. The waiter and the timer each hold a
+ * reference.
+ */
+typedef struct _deadline {
+  lc_timer_t timer;
+  channel_id cid;
+  channel_callback cb;
+  void *data;
+  int writer;
+  reader_t *waiter;    // while it is parked
+  volatile int refs;
+} deadline_t;
+
+static void deadline_free(deadline_t *d) {
+  if (atomic_ref_dec(&d->refs) == 0) {
+    lc_free(d);
+  }
+}
+
+static void deadline_callback(message_t *m, void *data, channel_status_t event) {
+  deadline_t *d = (deadline_t *) data;
+  if (lc_timer_cancel(&d->timer) == SUCCESS) {
+    deadline_free(d);
+  }
+  d->cb(m, d->data, event);
+  deadline_free(d);
+}
+
+static void deadline_expired(void *data) {
+  deadline_t *d = (deadline_t *) data;
+  reader_t *p = waiter_cancel(d->cid, &d->waiter, d->writer);
+
+  if (p) {
+    // a writer that never got to write hands its message back with the timeout
+    message_t *m = d->writer ? ((writer_t *) p)->message : NULL;
+    lc_free(p);
+    d->cb(m, d->data, timedout);
+    deadline_free(d);
+  }
+  deadline_free(d);
+}
+
+/*
+ * Writes m to the channel, or reads from it when m is NULL, giving up after millis if the
+ * operation has to wait (a negative millis waits for as long as it takes). The callback
+ * gets a timedout event if the deadline passes first.
+ */
+static int channel_wait(channel_t *c, message_t *m, channel_callback cb, void *data, long millis) {
+  if (millis < 0) {
+    return m ? channel_write(c, m, cb, data) : channel_read(c, cb, data);
+  }
+
+  deadline_t *d = lc_alloc(sizeof(deadline_t));
+  if (!d) return ERR_NOMEM;
+  d->cid = c->id;
+  d->cb = cb;
+  d->data = data;
+  d->writer = m != NULL;
+  d->waiter = NULL;
+  d->refs = 2;
+  lc_timer_init(&d->timer, deadline_expired, d);
+
+  int rc = m ? channel_write_claim(c, m, deadline_callback, d, NULL, 1, &d->waiter)
+      : channel_read_claim(c, deadline_callback, d, NULL, 1, &d->waiter);
+  if (rc == ERR_FULL || rc == ERR_EMPTY) {
+    // the waiter may have been served already, in which case the timer finds nothing. Without
+    // a timer it times out now rather than wait for ever
+    if (lc_timer_start(&d->timer, millis) != SUCCESS) deadline_expired(d);
+    return rc;
+  } else if (rc != SUCCESS) {
+    lc_free(d);
+    return rc;
+  }
+  deadline_free(d);
   return rc;
 }
 
@@ -279,9 +834,18 @@ int lua_pushchannel(lua_State *L, channel_t *c) {
   return SUCCESS;
 }
 
+static const char *const modes[] = { "mpmc", "spsc", NULL };
+
+/*
+ * Channel.new(size, mode) creates a channel buffering size messages. Channels are "mpmc"
+ * by default; an "spsc" channel is faster but only for one writer and one reader at a time,
+ * and needs a buffer.
+ */
 static int luaC_new(lua_State *L) {
   int size = luaL_optint(L, 1, 0);
-  channel_t *c = channel_new(size);
+  int spsc = luaL_checkoption(L, 2, "mpmc", modes);
+  luaL_argcheck(L, !spsc || size > 0, 1, "spsc channels need a buffer");
+  channel_t *c = channel_new(size, spsc ? CHANNEL_SPSC : 0);
   if (!c) return luaL_error(L, "Unable to create new channel");
 
   if (lua_pushchannel(L, c) != SUCCESS) {
@@ -292,11 +856,11 @@ static int luaC_new(lua_State *L) {
 }
 
 static int luaC_connect(lua_State *L) {
-  channel_id cid = luaL_checknumber(L, 1);
+  channel_id cid = (channel_id) luaL_checknumber(L, 1);
 
   channel_t *c = channel_ref(cid);
   if (lua_pushchannel(L, c) != SUCCESS) {
-    return luaL_error(L, "Unable to connect to channel <%f>", cid);
+    return luaL_error(L, "Unable to connect to channel <%f>", (lua_Number) cid);
   }
   return 1;
 }
@@ -333,26 +897,25 @@ static int luac_status(lua_State *L) {
 
 static int luac_tostring(lua_State *L) {
   lua_Channel *lc = get_channel(L, 1);
-  lua_pushfstring(L, CASTING_CHANNEL " <%f>", lc->cid);
+  lua_pushfstring(L, CASTING_CHANNEL " <%f>", (lua_Number) lc->cid);
   return 1;
 }
 
 static int luac_destroy(lua_State *L) {
   lua_Channel *lc = get_channel(L, 1);
-  channel_t *c = channel_find(lc->cid);
-  channel_free(c);
-  return 1;
+  lc_handle_release(channels, lc->cid);
+  return 0;
 }
 
 static int luac_save(lua_State *L) {
   lua_Channel *lc = get_channel(L, 1);
   lua_pushstring(L, CASTING_CHANNEL);
-  lua_pushnumber(L, lc->cid);
+  lua_pushnumber(L, (lua_Number) lc->cid);
   return 2;
 }
 
 static int luac_load(lua_State *L) {
-  channel_id cid = lua_tonumber(L, 1);
+  channel_id cid = (channel_id) lua_tonumber(L, 1);
   channel_t *c = channel_ref(cid);
   if (lua_pushchannel(L, c) == SUCCESS) {
     return 1;
@@ -362,30 +925,62 @@ static int luac_load(lua_State *L) {
   return 1;
 }
 
-// TODO
-// TODO
-// TODO
+/*
+ * Callers that aren't running inside a task block their own thread until the channel
+ * operation completes, parked on the thread's event. The message is decoded by the caller
+ * once it wakes, so the callback never touches the caller's Lua state.
+ */
 typedef struct _session_cb {
-  lua_State *L;
-  lc_sem_t *sem;
+  lc_event_t *ev;
+  message_t *m;
+  channel_status_t event;
+  volatile int done;
 } session_cb;
 
 static void session_callback(message_t *m, void *data, channel_status_t event) {
   session_cb *s = (session_cb *) data;
-  lua_State *L = s->L;
+  lc_event_t *ev = s->ev;
   switch (event) {
     case read:
-      // TODO error check on message
-      lua_decodemessage(L, m);
-      lua_pushboolean(L, 1);
+      s->m = m;
       break;
     case write:
       // Do nothing - we only want the message to be sent
       break;
     case closed:
+    case timedout:
+    case cancelled:
+      if (m) msg_destroy(m);
       break;
   }
-  lc_sem_post(s->sem);
+  s->event = event;
+  // the caller may return as soon as it sees done, so the event must be read before
+  atomic_int_set(&s->done, 1);
+  lc_event_notify(ev);
+}
+
+static void event_await(lc_event_t *ev, volatile int *done) {
+  while (!atomic_int_get(done)) {
+    int key = lc_event_prepare(ev);
+    if (atomic_int_get(done)) {
+      lc_event_cancel(ev);
+      break;
+    }
+    lc_event_wait(ev, key, -1);
+  }
+}
+
+static void session_await(session_cb *s) {
+  event_await(s->ev, &s->done);
+}
+
+// resumes a task whose channel operation failed with nil and the reason
+static void task_fail(task_id tid, const char *reason) {
+  message_builder_t mb;
+  msg_builder_init(&mb);
+  lc_pushnil(&mb);
+  lc_pushlstring(&mb, reason, strlen(reason));
+  task_resume(tid, msg_new(&mb));
 }
 
 // TODO
@@ -403,18 +998,42 @@ static void task_callback(message_t *m, void *data, channel_status_t event) {
         message_builder_t mb;
         msg_builder_init(&mb);
         lc_pushboolean(&mb, 1);
+        // the message belongs to the channel now, and then to whoever reads it
         task_resume(*ptid, msg_new(&mb));
-        msg_destroy(m);
       }
       break;
     case closed:
+      if (m) msg_destroy(m);
+      task_fail(*ptid, "closed");
+      break;
+    case timedout:
+      if (m) msg_destroy(m);
+      task_fail(*ptid, "timeout");
+      break;
+    case cancelled:
+      if (m) msg_destroy(m);
       break;
   }
 
   lc_free(data);
 }
 
-static int luac_write(lua_State *L) {
+// the task to resume, for task_callback
+static task_id *task_data(task_id tid) {
+  task_id *ptid = lc_alloc(sizeof(task_id));
+  if (ptid) *ptid = tid;
+  return ptid;
+}
+
+// the values returned by a channel operation that didn't happen
+static int push_failure(lua_State *L, channel_status_t event) {
+  lua_pushnil(L);
+  lua_pushstring(L, event == timedout ? "timeout" : "closed");
+  return 2;
+}
+
+// writes the values from first on, giving up after millis unless that is negative
+static int channel_write_values(lua_State *L, int first, long millis) {
   lua_Channel *lc = get_channel(L, 1);
 
   // TODO error if channel is invalid or wont accept message !!
@@ -429,29 +1048,62 @@ static int luac_write(lua_State *L) {
     return 2;
   }
   task_id tid = task_current();
+  task_id *ptid = NULL;
+  if (tid && !(ptid = task_data(tid))) {
+    channel_free(c);
+    return luaL_error(L, "Unable to write. Insufficient memory ?");
+  }
 
   int top = lua_gettop(L);
-  message_t *m = lua_newmessage(L, top - 1);
+  message_t *m = lua_newmessage(L, top - first + 1);
+  if (!m) {
+    lc_free(ptid);
+    channel_free(c);
+    return luaL_error(L, "Unable to write. Insufficient memory ?");
+  }
 
+  int rc;
   if (tid) {
-    task_id *ptid = lc_alloc(sizeof(task_id));
-    *ptid = tid;
-    channel_write(c, m, task_callback, ptid);
+    rc = channel_wait(c, m, task_callback, ptid, millis);
     channel_free(c);
-    return task_yield(tid);
+    if (rc == SUCCESS || rc == ERR_FULL) return task_yield(tid);
+    lc_free(ptid);
   } else {
-    session_cb s = { L, lc_sem_new(0) };
-    if (channel_write(c, m, session_callback, &s) == ERR_FULL) {
-      lc_sem_wait(s.sem);
+    session_cb s = { lc_event_local(), NULL, write, 0 };
+    rc = channel_wait(c, m, session_callback, &s, millis);
+    if (rc == ERR_FULL) {
+      session_await(&s);
     }
-    lc_sem_destroy(s.sem);
     channel_free(c);
-    lua_pushboolean(L, 1);
-    return 1;
+    if (rc == SUCCESS || rc == ERR_FULL) {
+      if (s.event == closed || s.event == timedout) {
+        return push_failure(L, s.event);
+      }
+      lua_pushboolean(L, 1);
+      return 1;
+    }
   }
+
+  // closed since it was checked, or no memory for the deadline: the message is still ours
+  msg_destroy(m);
+  if (rc == ERR_NOMEM) {
+    return luaL_error(L, "Unable to write. Insufficient memory ?");
+  }
+  return push_failure(L, closed);
 }
 
-static int luac_read(lua_State *L) {
+static int luac_write(lua_State *L) {
+  return channel_write_values(L, 2, -1);
+}
+
+// channel:write_timeout(millis, ...) gives up with nil, "timeout" if it has to wait too long
+static int luac_write_timeout(lua_State *L) {
+  lua_Number millis = luaL_checknumber(L, 2);
+  luaL_argcheck(L, millis >= 0, 2, "negative timeout");
+  return channel_write_values(L, 3, (long) millis);
+}
+
+static int channel_read_value(lua_State *L, long millis) {
   lua_Channel *lc = get_channel(L, 1);
 
   channel_t *c = channel_ref(lc->cid);
@@ -466,23 +1118,521 @@ static int luac_read(lua_State *L) {
   }
 
   task_id tid = task_current();
+  int rc;
 
   if (tid) {
-    task_id *ptid = lc_alloc(sizeof(task_id));
-    *ptid = tid;
-    channel_read(c, task_callback, ptid);
+    task_id *ptid = task_data(tid);
+    if (!ptid) {
+      channel_free(c);
+      return luaL_error(L, "Unable to read. Insufficient memory ?");
+    }
+    rc = channel_wait(c, NULL, task_callback, ptid, millis);
     channel_free(c);
-    return task_yield(tid);
+    if (rc == SUCCESS || rc == ERR_EMPTY) return task_yield(tid);
+    lc_free(ptid);
   } else {
-    session_cb s = { L, lc_sem_new(0) };
-    if (channel_read(c, session_callback, &s) == ERR_FULL) {
-      lc_sem_wait(s.sem);
+    session_cb s = { lc_event_local(), NULL, read, 0 };
+    rc = channel_wait(c, NULL, session_callback, &s, millis);
+    if (rc == ERR_EMPTY) {
+      session_await(&s);
     }
-    lc_sem_destroy(s.sem);
     channel_free(c);
+    if (rc == SUCCESS || rc == ERR_EMPTY) {
+      if (!s.m) {
+        return push_failure(L, s.event);
+      }
+      int count = lua_decodemessage(L, s.m);
+      msg_destroy(s.m);
+      return count;
+    }
+  }
+
+  // closed since it was checked, or no memory for the deadline
+  if (rc == ERR_NOMEM) {
+    return luaL_error(L, "Unable to read. Insufficient memory ?");
+  }
+  return push_failure(L, closed);
+}
+
+static int luac_read(lua_State *L) {
+  return channel_read_value(L, -1);
+}
+
+// channel:read_timeout(millis) gives up with nil, "timeout" if nothing arrives in time
+static int luac_read_timeout(lua_State *L) {
+  lua_Number millis = luaL_checknumber(L, 2);
+  luaL_argcheck(L, millis >= 0, 2, "negative timeout");
+  return channel_read_value(L, (long) millis);
+}
+
+/*
+ * channel:write_many(...) writes each value as a message of its own, as if by a write()
+ * apiece, but takes the channel once for the lot and only wakes the writer once.
+ */
+static int luac_write_many(lua_State *L) {
+  lua_Channel *lc = get_channel(L, 1);
+  int count = lua_gettop(L) - 1;
+  luaL_argcheck(L, count <= CHANNEL_BATCH_MAX, CHANNEL_BATCH_MAX + 2, "too many values");
+  if (count == 0) {
     lua_pushboolean(L, 1);
     return 1;
   }
+
+  channel_t *c = channel_ref(lc->cid);
+  if (!c) {
+    return luaL_error(L, "Invalid channel");
+  }
+  if (c->status == channel_closed) {
+    channel_free(c);
+    return push_failure(L, closed);
+  }
+
+  task_id tid = task_current();
+  task_id *ptid = NULL;
+  if (tid && !(ptid = task_data(tid))) {
+    channel_free(c);
+    return luaL_error(L, "Unable to write. Insufficient memory ?");
+  }
+
+  message_t *ms[CHANNEL_BATCH_MAX];
+  for (int i = 0; i < count; i++) {
+    lua_pushvalue(L, i + 2);
+    if (!(ms[i] = lua_newmessage(L, 1))) {
+      while (i--) {
+        msg_destroy(ms[i]);
+      }
+      lc_free(ptid);
+      channel_free(c);
+      return luaL_error(L, "Unable to write. Insufficient memory ?");
+    }
+  }
+
+  int rc;
+  if (tid) {
+    rc = channel_write_many(c, ms, count, task_callback, ptid);
+    channel_free(c);
+    if (rc != ERR_CLOSED) return task_yield(tid);
+    lc_free(ptid);
+  } else {
+    session_cb s = { lc_event_local(), NULL, write, 0 };
+    rc = channel_write_many(c, ms, count, session_callback, &s);
+    if (rc == ERR_FULL) {
+      session_await(&s);
+    }
+    channel_free(c);
+    if (rc != ERR_CLOSED) {
+      if (s.event == closed) return push_failure(L, closed);
+      lua_pushboolean(L, 1);
+      return 1;
+    }
+  }
+
+  // closed in the meantime
+  for (int i = 0; i < count; i++) {
+    msg_destroy(ms[i]);
+  }
+  return push_failure(L, closed);
+}
+
+/*
+ * A read_many() that had to wait. Whoever hands it the first message also takes up to max
+ * more that are ready, so that the reader wakes up once with the lot in a single message.
+ */
+typedef struct _batch {
+  channel_id cid;
+  int max;
+  channel_callback cb;
+  void *data;
+} batch_t;
+
+static void batch_callback(message_t *m, void *data, channel_status_t event) {
+  batch_t *b = (batch_t *) data;
+
+  if (event == read && b->max > 0) {
+    message_t *ms[CHANNEL_BATCH_MAX];
+    int n = 0;
+    ms[0] = m;
+
+    channel_t *c = channel_ref(b->cid);
+    if (c) {
+      n = channel_take(c, ms + 1, b->max);
+      channel_free(c);
+    }
+    if (n > 0) {
+      message_t *all = msg_concat(ms, n + 1);
+      if (all) {
+        m = all;
+      } else {
+        // out of memory, the reader gets what it was waiting for and no more
+        for (int i = 1; i <= n; i++) {
+          msg_destroy(ms[i]);
+        }
+      }
+    }
+  }
+
+  b->cb(m, b->data, event);
+  lc_free(b);
+}
+
+/*
+ * channel:read_many(max) returns the values of up to max messages (CHANNEL_BATCH_MAX by
+ * default), waiting only if there are none. Each write_many() value comes back as one.
+ */
+static int luac_read_many(lua_State *L) {
+  lua_Channel *lc = get_channel(L, 1);
+  int max = luaL_optint(L, 2, CHANNEL_BATCH_MAX);
+  luaL_argcheck(L, max > 0 && max <= CHANNEL_BATCH_MAX, 2, "invalid batch size");
+
+  channel_t *c = channel_ref(lc->cid);
+  if (!c) {
+    return luaL_error(L, "Invalid channel");
+  }
+
+  message_t *ms[CHANNEL_BATCH_MAX];
+  int n = channel_take(c, ms, max);
+  if (n == ERR_CLOSED) {
+    channel_free(c);
+    return push_failure(L, closed);
+  }
+  if (n > 0) {
+    channel_free(c);
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+      count += lua_decodemessage(L, ms[i]);
+      msg_destroy(ms[i]);
+    }
+    return count;
+  }
+
+  batch_t *b = lc_alloc(sizeof(batch_t));
+  if (!b) {
+    channel_free(c);
+    return luaL_error(L, "Unable to read. Insufficient memory ?");
+  }
+  b->cid = lc->cid;
+  b->max = max - 1;
+
+  task_id tid = task_current();
+  int rc;
+  if (tid) {
+    task_id *ptid = task_data(tid);
+    if (!ptid) {
+      lc_free(b);
+      channel_free(c);
+      return luaL_error(L, "Unable to read. Insufficient memory ?");
+    }
+    b->cb = task_callback;
+    b->data = ptid;
+    rc = channel_read(c, batch_callback, b);
+    channel_free(c);
+    if (rc == SUCCESS || rc == ERR_EMPTY) return task_yield(tid);
+    lc_free(ptid);
+  } else {
+    session_cb s = { lc_event_local(), NULL, read, 0 };
+    b->cb = session_callback;
+    b->data = &s;
+    rc = channel_read(c, batch_callback, b);
+    if (rc == ERR_EMPTY) {
+      session_await(&s);
+    }
+    channel_free(c);
+    if (rc == SUCCESS || rc == ERR_EMPTY) {
+      if (!s.m) return push_failure(L, s.event);
+      int count = lua_decodemessage(L, s.m);
+      msg_destroy(s.m);
+      return count;
+    }
+  }
+
+  // closed since it was checked, or no memory to wait
+  lc_free(b);
+  if (rc == ERR_NOMEM) {
+    return luaL_error(L, "Unable to read. Insufficient memory ?");
+  }
+  return push_failure(L, closed);
+}
+
+/*
+ * A select waits on one channel per case, with a waiter that points back to its case. The
+ * waiters all share the select's claim, so the first to be served is the only one, and
+ * the select then takes the rest off their channels. The select holds a reference for its
+ * caller, one for each waiter and one for its timer.
+ */
+typedef struct _select select_t;
+
+typedef struct _select_case {
+  select_t *sel;
+  int idx;
+  channel_id cid;
+  int writer;
+  reader_t *waiter;    // while it is parked
+} select_case_t;
+
+struct _select {
+  volatile int claim;
+  volatile int refs;
+  int ncases;
+  task_id tid;         // the task waiting, if it is a task
+  lc_event_t *ev;      // otherwise the waiting thread's event, and where the result goes
+  message_t *result;
+  volatile int done;
+  lc_timer_t timer;
+  select_case_t cases[SELECT_MAX];
+};
+
+static void select_free(select_t *s) {
+  if (atomic_ref_dec(&s->refs) == 0) {
+    lc_free(s);
+  }
+}
+
+// claims the select for something other than a channel: a close, the timer or the default
+static int select_claim(select_t *s) {
+  for (;;) {
+    if (atomic_int_cas(&s->claim, CLAIM_OPEN, CLAIM_DONE)) return 1;
+    if (atomic_int_get(&s->claim) == CLAIM_DONE) return 0;
+    cpu_relax();
+  }
+}
+
+/*
+ * Takes the waiters of a select that has been claimed off their channels, like a deadline
+ * does, so they don't sit there until something comes along. The waiter that was served,
+ * and any a channel has already dropped, are no longer queued.
+ */
+static void select_cancel(select_t *s) {
+  for (int i = 0; i < s->ncases; i++) {
+    select_case_t *k = &s->cases[i];
+    reader_t *p = waiter_cancel(k->cid, &k->waiter, k->writer);
+    if (p) {
+      if (k->writer) msg_destroy(((writer_t *) p)->message);
+      lc_free(p);
+      select_free(s);
+    }
+  }
+}
+
+// hands the result to the caller of a select that has been claimed
+static void select_finish(select_t *s, message_t *result) {
+  if (lc_timer_cancel(&s->timer) == SUCCESS) {
+    select_free(s);
+  }
+  select_cancel(s);
+  if (s->tid) {
+    task_resume(s->tid, result);
+  } else {
+    lc_event_t *ev = s->ev;
+    s->result = result;
+    atomic_int_set(&s->done, 1);
+    lc_event_notify(ev);
+  }
+}
+
+static void select_fail(select_t *s, const char *reason, int idx) {
+  message_builder_t mb;
+  msg_builder_init(&mb);
+  lc_pushnil(&mb);
+  lc_pushlstring(&mb, reason, strlen(reason));
+  if (idx) lc_pushnumber(&mb, idx);
+  select_finish(s, msg_new(&mb));
+}
+
+static void select_callback(message_t *m, void *data, channel_status_t event) {
+  select_case_t *k = (select_case_t *) data;
+  select_t *s = k->sel;
+  message_builder_t mb;
+  msg_builder_init(&mb);
+
+  switch (event) {
+    case read:
+      {
+        // the case that fired, then what was read
+        lc_pushnumber(&mb, k->idx);
+        message_t *ms[2] = { msg_new(&mb), m };
+        message_t *result = msg_concat(ms, 2);
+        if (!result) {
+          msg_destroy(m);
+          result = ms[0];
+        }
+        select_finish(s, result);
+      }
+      break;
+    case write:
+      lc_pushnumber(&mb, k->idx);
+      lc_pushboolean(&mb, 1);
+      select_finish(s, msg_new(&mb));
+      break;
+    case closed:
+      if (m) msg_destroy(m);
+      if (select_claim(s)) select_fail(s, "closed", k->idx);
+      break;
+    case timedout:
+    case cancelled:
+      if (m) msg_destroy(m);
+      break;
+  }
+  select_free(s);
+}
+
+static void select_expired(void *data) {
+  select_t *s = (select_t *) data;
+  if (select_claim(s)) select_fail(s, "timeout", 0);
+  select_free(s);
+}
+
+static lua_Channel *to_channel(lua_State *L, int idx) {
+  lua_Channel *lc = (lua_Channel *) lua_touserdata(L, idx);
+  if (lc && lua_getmetatable(L, idx)) {
+    luaL_getmetatable(L, CASTING_CHANNEL);
+    int ok = lua_rawequal(L, -1, -2);
+    lua_pop(L, 2);
+    if (ok) return lc;
+  }
+  return NULL;
+}
+
+/*
+ * casting.select{ {ch1, "read"}, {ch2, "write", ...}, timeout = millis, default = true }
+ * does whichever of the reads and writes can go ahead first (the earliest case, if more
+ * than one can right away), and returns the number of that case followed by what was read,
+ * or true for a write. It returns nil, "closed" and the case for a case whose channel is
+ * closed, nil, "timeout" once the timeout has passed and nil, "default" straight away if
+ * there is a default and no case can go ahead. With a default the cases are only tried,
+ * and nothing waits on any channel.
+ */
+int lc_select(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int ncases = lua_objlen(L, 1);
+  luaL_argcheck(L, ncases > 0 && ncases <= SELECT_MAX, 1, "invalid number of cases");
+
+  lua_getfield(L, 1, "timeout"); // [timeout]
+  lua_Number timeout = lua_isnil(L, -1) ? -1 : lua_tonumber(L, -1);
+  lua_getfield(L, 1, "default"); // [timeout][default]
+  int dflt = lua_toboolean(L, -1);
+  lua_pop(L, 2); // []
+
+  // check every case before writing anything
+  channel_id cids[SELECT_MAX];
+  int writes[SELECT_MAX];
+  for (int i = 0; i < ncases; i++) {
+    lua_rawgeti(L, 1, i + 1); // [case]
+    if (!lua_istable(L, -1)) {
+      return luaL_error(L, "select case %d is not a table", i + 1);
+    }
+    lua_rawgeti(L, -1, 1); // [case][ch]
+    lua_rawgeti(L, -2, 2); // [case][ch][mode]
+    lua_Channel *lc = to_channel(L, -2);
+    const char *mode = lua_tostring(L, -1);
+    if (!lc) {
+      return luaL_error(L, "select case %d has no channel", i + 1);
+    }
+    if (!mode || (strcmp(mode, "read") && strcmp(mode, "write"))) {
+      return luaL_error(L, "select case %d should \"read\" or \"write\"", i + 1);
+    }
+    cids[i] = lc->cid;
+    writes[i] = mode[0] == 'w';
+    lua_pop(L, 3); // []
+  }
+
+  select_t *s = lc_alloc(sizeof(select_t));
+  if (!s) {
+    return luaL_error(L, "Unable to select. Insufficient memory ?");
+  }
+  memset(s, 0, sizeof(select_t));
+  s->refs = 1;
+  s->ncases = ncases;
+  for (int i = 0; i < ncases; i++) {
+    select_case_t *k = &s->cases[i];
+    k->sel = s;
+    k->idx = i + 1;
+    k->cid = cids[i];
+    k->writer = writes[i];
+  }
+  s->tid = task_current();
+  if (!s->tid) s->ev = lc_event_local();
+  lc_timer_init(&s->timer, select_expired, s);
+
+  message_t *ms[SELECT_MAX];
+  for (int i = 0; i < ncases; i++) {
+    ms[i] = NULL;
+    if (!writes[i]) continue;
+    int top = lua_gettop(L);
+    lua_rawgeti(L, 1, i + 1); // [case]
+    int n = lua_objlen(L, -1);
+    for (int j = 3; j <= n; j++) {
+      lua_rawgeti(L, top + 1, j); // [case][values]
+    }
+    ms[i] = lua_newmessage(L, n > 2 ? n - 2 : 0); // [case]
+    if (!ms[i]) {
+      while (i--) {
+        if (ms[i]) msg_destroy(ms[i]);
+      }
+      select_free(s);
+      return luaL_error(L, "Unable to select. Insufficient memory ?");
+    }
+    lua_pop(L, 1); // []
+  }
+
+  int nomem = 0;
+  for (int i = 0; i < ncases && atomic_int_get(&s->claim) != CLAIM_DONE; i++) {
+    select_case_t *k = &s->cases[i];
+    int rc = ERR_CLOSED;
+    channel_t *c = channel_ref(cids[i]);
+    atomic_ref_inc(&s->refs);
+    if (c) {
+      if (writes[i]) {
+        rc = channel_write_claim(c, ms[i], select_callback, k, &s->claim, !dflt, &k->waiter);
+      } else {
+        rc = channel_read_claim(c, select_callback, k, &s->claim, !dflt, &k->waiter);
+      }
+      channel_free(c);
+    }
+
+    if (rc == SUCCESS || rc == ERR_FULL || rc == ERR_EMPTY) {
+      // the message belongs to the channel, and the reference to the waiter
+      ms[i] = NULL;
+    } else {
+      if (rc == ERR_CLOSED && select_claim(s)) select_fail(s, "closed", i + 1);
+      if (rc == ERR_NOMEM && select_claim(s)) {
+        // nothing can be waited on, so take back the cases already parked
+        select_cancel(s);
+        nomem = 1;
+      }
+      select_free(s);
+    }
+  }
+  for (int i = 0; i < ncases; i++) {
+    if (ms[i]) msg_destroy(ms[i]);
+  }
+  if (nomem) {
+    select_free(s);
+    return luaL_error(L, "Unable to select. Insufficient memory ?");
+  }
+
+  if (dflt && select_claim(s)) {
+    select_free(s);
+    lua_pushnil(L);
+    lua_pushstring(L, "default");
+    return 2;
+  }
+  if (timeout >= 0 && atomic_int_get(&s->claim) != CLAIM_DONE) {
+    atomic_ref_inc(&s->refs);
+    if (lc_timer_start(&s->timer, (long) timeout) != SUCCESS) select_free(s);
+  }
+
+  if (s->tid) {
+    task_id tid = s->tid;
+    select_free(s);
+    return task_yield(tid);
+  }
+
+  event_await(s->ev, &s->done);
+  message_t *result = s->result;
+  select_free(s);
+  int count = lua_decodemessage(L, result);
+  msg_destroy(result);
+  return count;
 }
 
 static int luac_size(lua_State *L) {
@@ -502,6 +1652,10 @@ static const luaL_Reg methods[] = { { "__tostring", luac_tostring },
                                      { "__len", luac_size },
                                      { "write", luac_write },
                                      { "read", luac_read },
+                                     { "write_timeout", luac_write_timeout },
+                                     { "read_timeout", luac_read_timeout },
+                                     { "write_many", luac_write_many },
+                                     { "read_many", luac_read_many },
                                      { "__save", luac_save },
                                      { "__load", luac_load },
                                      { "close", luac_close },
@@ -512,8 +1666,7 @@ void init_channel( ) {
   static int init = 0;
 
   while (!atomic_int_cas(&init, 1, 1)) {
-    lock = lc_spin_new();
-    channels = map_new(cmp_channel, dup_channel, rel_channel);
+    channels = lc_handles_new(channel_destroy);
     INFO("Initialized channel");
     init = 1;
   }
@@ -3,30 +3,41 @@
 
 #include "casting.h"
 #include "message.h"
+#include "lc_handle.h"
 
 #define CASTING_CHANNEL   "casting.channel"
 
 typedef struct _channel channel_t;
-typedef double channel_id;
+typedef lc_handle_t channel_id;
 
 typedef struct {
   channel_id cid;
 } lua_Channel;
 
 typedef enum {
-  read, write, closed
+  read, write, closed, timedout, cancelled
 } channel_status_t;
 
 #define READABLE  0x01
 #define WRITABLE  0x02
 #define CLOSING   0x04
 
-channel_t *channel_new(int size);
+#define CHANNEL_SPSC  0x01
+
+#define CHANNEL_BATCH_MAX   256
+#define SELECT_MAX          64
+
+channel_t *channel_new(int size, int flags);
 int channel_close(channel_t *c);
 
 typedef void(*channel_callback)(message_t *m, void *p, channel_status_t event);
 
 int channel_write(channel_t *c, message_t *m, channel_callback cb, void *data);
 int channel_read(channel_t *c, channel_callback cb, void *data);
+int channel_write_many(channel_t *c, message_t **ms, int count, channel_callback cb,
+    void *data);
+int channel_take(channel_t *c, message_t **ms, int max);
+
+int lc_select(lua_State *L);
 
 #endif //__LC_CHANNEL_H__
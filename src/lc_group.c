@@ -0,0 +1,173 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "casting.h"
+#include "lc_group.h"
+
+static const char *const balances[] = { "queue", "time", NULL };
+
+static lua_Group *get_group(lua_State *L, int idx) {
+  return luaL_checkudata(L, idx, CASTING_GROUP);
+}
+
+/*
+ * Grows or shrinks the group to size sessions. Sessions that leave the group finish the
+ * tasks they have queued, but like any closed session they are gone once those have run.
+ */
+static int group_resize(lua_Group *g, int size) {
+  if (size < 0 || size > GROUP_MAX_SIZE) return ERR_INVAL;
+
+  while (g->count > size) {
+    session_close(g->sessions[--g->count]);
+  }
+  if (g->count == 0) {
+    // lc_realloc() can't grow a block it doesn't know the size of
+    lc_free(g->sessions);
+    g->sessions = NULL;
+  }
+  if (size == g->count) return SUCCESS;
+
+  session_id *sessions = lc_realloc(g->sessions, sizeof(session_id) * g->count,
+      sizeof(session_id) * size);
+  if (!sessions) return ERR_NOMEM;
+  g->sessions = sessions;
+
+  while (g->count < size) {
+    session_id sid = session_new();
+    if (sid == HANDLE_NONE) return ERR_NOMEM;
+    g->sessions[g->count++] = sid;
+  }
+  return SUCCESS;
+}
+
+// the member to start the next task on, or HANDLE_NONE for an empty group
+static session_id group_pick(lua_Group *g) {
+  int best = -1;
+  uint64_t best_load = 0;
+
+  for (int i = 0; i < g->count; i++) {
+    int k = (g->next + i) % g->count;
+    int pending;
+    uint64_t task_usec;
+    if (session_load(g->sessions[k], &pending, &task_usec) != SUCCESS) continue;
+
+    uint64_t load = pending;
+    if (g->balance == GROUP_BALANCE_TIME) load *= task_usec + 1;
+    if (best < 0 || load < best_load) {
+      best = k;
+      best_load = load;
+      if (load == 0) break;
+    }
+  }
+
+  if (best < 0) return HANDLE_NONE;
+  g->next = (best + 1) % g->count;
+  return g->sessions[best];
+}
+
+/*
+ * Group.new(size, balance) creates a group of size sessions, balancing new tasks by
+ * "queue" (the default) or "time".
+ */
+static int luaG_new(lua_State *L) {
+  int size = luaL_checkint(L, 1);
+  int balance = luaL_checkoption(L, 2, "queue", balances);
+  luaL_argcheck(L, size >= 0 && size <= GROUP_MAX_SIZE, 1, "invalid group size");
+
+  lua_Group *g = (lua_Group *) lua_newuserdata(L, sizeof(lua_Group)); // [group]
+  memset(g, 0, sizeof(lua_Group));
+  g->balance = balance;
+  luaL_getmetatable(L, CASTING_GROUP); // [group][meta]
+  lua_setmetatable(L, -2); // [group]
+
+  if (group_resize(g, size) != SUCCESS) {
+    return luaL_error(L, "Error creating group. Insufficient memory ?");
+  }
+  return 1;
+}
+
+// group:create(fn, ...) starts a task on the least loaded member, like session:create()
+static int luag_create(lua_State *L) {
+  lua_Group *g = get_group(L, 1);
+  session_id sid = group_pick(g);
+  if (sid == HANDLE_NONE) {
+    return luaL_error(L, "No sessions in group");
+  }
+  return lc_spawntask(L, sid);
+}
+
+static int luag_resize(lua_State *L) {
+  lua_Group *g = get_group(L, 1);
+  int size = luaL_checkint(L, 2);
+  int rc = group_resize(g, size);
+  if (rc != SUCCESS) {
+    return luaL_error(L, "Unable to resize group: %s", errmsg(rc));
+  }
+  return 0;
+}
+
+static int luag_size(lua_State *L) {
+  lua_Group *g = get_group(L, 1);
+  lua_pushnumber(L, g->count);
+  return 1;
+}
+
+/*
+ * group:loads() returns, for each member, the number of tasks it has waiting and how long
+ * its tasks have been running for lately, in microseconds.
+ */
+static int luag_loads(lua_State *L) {
+  lua_Group *g = get_group(L, 1);
+  lua_createtable(L, g->count, 0); // [loads]
+  for (int i = 0; i < g->count; i++) {
+    int pending = 0;
+    uint64_t task_usec = 0;
+    session_load(g->sessions[i], &pending, &task_usec);
+    lua_createtable(L, 0, 2); // [loads][load]
+    lua_pushnumber(L, pending);
+    lua_setfield(L, -2, "pending");
+    lua_pushnumber(L, task_usec);
+    lua_setfield(L, -2, "task_usec");
+    lua_rawseti(L, -2, i + 1); // [loads]
+  }
+  return 1;
+}
+
+static int luag_close(lua_State *L) {
+  lua_Group *g = get_group(L, 1);
+  group_resize(g, 0);
+  return 0;
+}
+
+static int luag_tostring(lua_State *L) {
+  lua_Group *g = get_group(L, 1);
+  lua_pushfstring(L, CASTING_GROUP " <%d sessions>", g->count);
+  return 1;
+}
+
+static const luaL_Reg funcs[] = { { "new", luaG_new },
+                                  { NULL, NULL } };
+
+static const luaL_Reg methods[] = { { "__gc", luag_close },
+                                    { "__tostring", luag_tostring },
+                                    { "__len", luag_size },
+                                    { "create", luag_create },
+                                    { "resize", luag_resize },
+                                    { "size", luag_size },
+                                    { "loads", luag_loads },
+                                    { "close", luag_close },
+                                    { NULL, NULL } };
+
+int lc_open_group(lua_State *L) {
+  lua_newtable(L); // [tbl]
+  luaL_register(L, NULL, funcs); // [tbl]
+
+  if (luaL_newmetatable(L, CASTING_GROUP) == 1) {
+    luaL_register(L, NULL, methods); // [tbl][tbl]
+    lua_setfield(L, -1, "__index");
+  }
+  return 0;
+}
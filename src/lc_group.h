@@ -0,0 +1,27 @@
+#ifndef __LC_GROUP_H__
+#define __LC_GROUP_H__
+
+#include "casting.h"
+#include "lc_session.h"
+
+#define CASTING_GROUP     "casting.group"
+
+#define GROUP_MAX_SIZE    1024
+
+/*
+ * A group owns a set of sessions and starts each new task on whichever member is the
+ * least loaded, by the number of tasks it has waiting or by how long those are likely to
+ * take to run.
+ */
+typedef enum {
+  GROUP_BALANCE_QUEUE=0, GROUP_BALANCE_TIME
+} group_balance_t;
+
+typedef struct {
+  session_id *sessions;
+  int count;
+  int balance;
+  int next;      // where the next search starts, so that ties go round the members
+} lua_Group;
+
+#endif // __LC_GROUP_H__
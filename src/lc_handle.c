@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "casting.h"
+#include "lc_atomic.h"
+#include "lc_handle.h"
+
+#define HANDLE_SLOTS        (1 << HANDLE_INDEX_BITS)
+#define HANDLE_CHUNK        (1 << HANDLE_CHUNK_BITS)
+#define HANDLE_CHUNKS       (HANDLE_SLOTS / HANDLE_CHUNK)
+#define HANDLE_GEN_MASK     ((1U << HANDLE_GEN_BITS) - 1)
+
+/*
+ * A slot's state word is its generation in the high 32 bits and the number of references
+ * to its object in the low 32. A slot is free while it has no references, and dropping the
+ * last one moves it on to the next generation in the same step, so a reference can only
+ * ever be taken on a live object with a current handle. Slots are allocated in chunks that
+ * are never freed, which is what lets a stale handle look at its slot safely.
+ */
+typedef struct _slot {
+  volatile uint64_t state;
+  void *volatile obj;
+  volatile uint32_t next;
+} slot_t;
+
+struct _lc_handles {
+  handle_destroy_fn destroy;
+  volatile uint64_t free;    // ABA tag in the high 32 bits, index + 1 of the first free slot
+  volatile int used;
+  volatile int live;
+  slot_t *volatile chunks[HANDLE_CHUNKS];
+};
+
+static inline uint32_t handle_index(lc_handle_t h) {
+  return h & (HANDLE_SLOTS - 1);
+}
+
+static inline uint32_t handle_gen(lc_handle_t h) {
+  return (h >> HANDLE_INDEX_BITS) & HANDLE_GEN_MASK;
+}
+
+static inline uint32_t next_gen(uint32_t gen) {
+  gen = (gen + 1) & HANDLE_GEN_MASK;
+  return gen ? gen : 1;
+}
+
+static inline slot_t *slot_at(lc_handles_t *t, uint32_t idx) {
+  slot_t *chunk = atomic_ptr_get_acquire(&t->chunks[idx >> HANDLE_CHUNK_BITS]);
+  return chunk ? &chunk[idx & (HANDLE_CHUNK - 1)] : NULL;
+}
+
+lc_handles_t *lc_handles_new(handle_destroy_fn destroy) {
+  lc_handles_t *t = lc_alloc(sizeof(lc_handles_t));
+  if (t) {
+    memset(t, 0, sizeof(lc_handles_t));
+    t->destroy = destroy;
+  }
+  return t;
+}
+
+int lc_handles_count(lc_handles_t *t) {
+  if (!t) return ERR_INVAL;
+  return atomic_int_get_relaxed(&t->live);
+}
+
+static void slot_push(lc_handles_t *t, uint32_t idx) {
+  slot_t *s = slot_at(t, idx);
+  uint64_t head;
+  do {
+    head = t->free;
+    s->next = (uint32_t) head;
+  } while (!atomic_u64_cas(&t->free, head, ((head >> 32) + 1) << 32 | (idx + 1)));
+}
+
+static int slot_pop(lc_handles_t *t) {
+  uint64_t head;
+  uint32_t idx;
+  do {
+    head = atomic_u64_get_acquire(&t->free);
+    if ((uint32_t) head == 0) return -1;
+    idx = (uint32_t) head - 1;
+  } while (!atomic_u64_cas(&t->free, head, ((head >> 32) + 1) << 32 | slot_at(t, idx)->next));
+  return idx;
+}
+
+// takes a slot from the free list, or failing that the next one never used
+static int slot_alloc(lc_handles_t *t) {
+  int idx = slot_pop(t);
+  if (idx >= 0) return idx;
+
+  idx = atomic_int_inc(&t->used) - 1;
+  if (idx >= HANDLE_SLOTS) {
+    atomic_int_dec(&t->used);
+    return -1;
+  }
+
+  slot_t *volatile *pchunk = &t->chunks[idx >> HANDLE_CHUNK_BITS];
+  if (!atomic_ptr_get_acquire(pchunk)) {
+    slot_t *chunk = lc_alloc(sizeof(slot_t) * HANDLE_CHUNK);
+    if (!chunk) return -1;
+    memset(chunk, 0, sizeof(slot_t) * HANDLE_CHUNK);
+    if (!atomic_ptr_cas(pchunk, NULL, chunk)) {
+      lc_free(chunk);
+    }
+  }
+  return idx;
+}
+
+/*
+ * Registers an object, returning a handle that holds the first reference to it, or
+ * HANDLE_NONE if the table is full.
+ */
+lc_handle_t lc_handle_new(lc_handles_t *t, void *obj) {
+  if (!t || !obj) return HANDLE_NONE;
+
+  int idx = slot_alloc(t);
+  if (idx < 0) return HANDLE_NONE;
+
+  // nobody can take a reference while there are none, so the slot is ours to fill in
+  slot_t *s = slot_at(t, idx);
+  uint32_t gen = s->state >> 32;
+  if (gen == 0) gen = 1;
+  s->obj = obj;
+  atomic_u64_set_release(&s->state, (uint64_t) gen << 32 | 1);
+  atomic_int_add_relaxed(&t->live, 1);
+
+  return (lc_handle_t) gen << HANDLE_INDEX_BITS | idx;
+}
+
+/*
+ * Takes a reference to the object named by a handle, returning NULL if the handle is stale
+ * or was never handed out.
+ */
+void *lc_handle_ref(lc_handles_t *t, lc_handle_t h) {
+  if (!t || h == HANDLE_NONE) return NULL;
+  uint32_t idx = handle_index(h);
+  if (idx >= (uint32_t) atomic_int_get_acquire(&t->used)) return NULL;
+  slot_t *s = slot_at(t, idx);
+  if (!s) return NULL;
+
+  uint32_t gen = handle_gen(h);
+  for (;;) {
+    uint64_t state = atomic_u64_get_acquire(&s->state);
+    if ((state >> 32) != gen || (uint32_t) state == 0) return NULL;
+    if (atomic_u64_cas(&s->state, state, state + 1)) return s->obj;
+  }
+}
+
+/*
+ * Drops a reference. The last one destroys the object, and retires the handle along with
+ * every copy of it.
+ */
+int lc_handle_release(lc_handles_t *t, lc_handle_t h) {
+  if (!t || h == HANDLE_NONE) return ERR_INVAL;
+  uint32_t idx = handle_index(h);
+  if (idx >= (uint32_t) atomic_int_get_acquire(&t->used)) return ERR_INVAL;
+  slot_t *s = slot_at(t, idx);
+  if (!s) return ERR_INVAL;
+
+  uint32_t gen = handle_gen(h);
+  uint64_t state, n;
+  do {
+    state = atomic_u64_get_acquire(&s->state);
+    if ((state >> 32) != gen || (uint32_t) state == 0) return ERR_INVAL;
+    n = state - 1;
+    if ((uint32_t) n == 0) n = (uint64_t) next_gen(gen) << 32;
+  } while (!atomic_u64_cas(&s->state, state, n));
+
+  if ((uint32_t) n == 0) {
+    void *obj = s->obj;
+    s->obj = NULL;
+    atomic_int_add_relaxed(&t->live, -1);
+    if (t->destroy) t->destroy(obj);
+    slot_push(t, idx);
+  }
+  return SUCCESS;
+}
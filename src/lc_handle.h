@@ -0,0 +1,31 @@
+#ifndef __LC_HANDLE_H__
+#define __LC_HANDLE_H__
+
+#include <stdint.h>
+#include "lc_error.h"
+
+/*
+ * Handles name the objects that are shared between sessions - sessions, tasks and channels
+ * - and hold the reference count for them. A handle is the index of a slot in its table
+ * plus the generation of the slot when it was handed out, so a handle to an object that has
+ * since been destroyed never finds the slot's next occupant. Lookups and reference counting
+ * are lock free, and handles fit in 53 bits so that Lua numbers carry them exactly.
+ */
+typedef uint64_t lc_handle_t;
+
+#define HANDLE_NONE         0
+#define HANDLE_INDEX_BITS   24
+#define HANDLE_GEN_BITS     29
+#define HANDLE_CHUNK_BITS   12
+
+typedef struct _lc_handles lc_handles_t;
+typedef void (*handle_destroy_fn)(void *obj);
+
+lc_handles_t *lc_handles_new(handle_destroy_fn destroy);
+int lc_handles_count(lc_handles_t *t);
+
+lc_handle_t lc_handle_new(lc_handles_t *t, void *obj);
+void *lc_handle_ref(lc_handles_t *t, lc_handle_t h);
+int lc_handle_release(lc_handles_t *t, lc_handle_t h);
+
+#endif // __LC_HANDLE_H__
@@ -0,0 +1,652 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include <ev.h>
+#include <lua.h>
+#include <lauxlib.h>
+#include <lualib.h>
+
+#include "casting.h"
+#include "message.h"
+#include "lc_thread.h"
+#include "lc_timer.h"
+#include "lc_session.h"
+#include "lc_reactor.h"
+
+struct _lc_watch {
+  ev_io io;
+  reactor_fn fn;
+  void *data;
+  volatile int refs;    // the reactor's, the caller's and one for each cancel in flight
+  struct _lc_watch *next_start;
+  struct _lc_watch *next_cancel;
+  struct _lc_watch *prev_active;
+  struct _lc_watch *next_active;
+};
+
+// a descriptor to close once nothing is watching it any more
+typedef struct _close_req {
+  int fd;
+  int rc;
+  lc_event_t *ev;
+  volatile int done;
+  struct _close_req *next;
+} close_req_t;
+
+/*
+ * The loop belongs to the reactor thread. Other threads hand it watches to start or cancel
+ * through the pending lists, and an async watcher to wake it up.
+ */
+static pthread_once_t reactor_once = PTHREAD_ONCE_INIT;
+static struct ev_loop *loop;        // NULL if the reactor couldn't be started
+static ev_async wakeup;
+static lc_spin_t *pending_lock;
+static lc_watch_t *starting = NULL;
+static lc_watch_t *cancelling = NULL;
+static close_req_t *closing = NULL;
+static lc_watch_t *active = NULL;   // the started watches, only seen by the reactor thread
+
+static void watch_free(lc_watch_t *w) {
+  if (atomic_ref_dec(&w->refs) == 0) {
+    lc_free(w);
+  }
+}
+
+static inline int ev_events(int events) {
+  return (events & LC_IO_READ ? EV_READ : 0) | (events & LC_IO_WRITE ? EV_WRITE : 0);
+}
+
+static inline int io_events(int revents) {
+  return (revents & EV_READ ? LC_IO_READ : 0) | (revents & EV_WRITE ? LC_IO_WRITE : 0);
+}
+
+static void watch_start(struct ev_loop *l, lc_watch_t *w) {
+  ev_io_start(l, &w->io);
+  w->prev_active = NULL;
+  w->next_active = active;
+  if (active) active->prev_active = w;
+  active = w;
+}
+
+// stops the watch and drops the reactor's reference to it
+static void watch_stop(struct ev_loop *l, lc_watch_t *w) {
+  ev_io_stop(l, &w->io);
+  if (w->prev_active) w->prev_active->next_active = w->next_active;
+  else active = w->next_active;
+  if (w->next_active) w->next_active->prev_active = w->prev_active;
+  watch_free(w);
+}
+
+static void watch_ready(struct ev_loop *l, ev_io *io, int revents) {
+  lc_watch_t *w = (lc_watch_t *) io;
+  // on an error pass on the events watched for, so the function finds out for itself
+  int events = io_events(revents & EV_ERROR ? io->events : revents);
+  int again = ev_events(w->fn(io->fd, events, w->data));
+
+  if (!again) {
+    watch_stop(l, w);
+  } else if (again != (io->events & (EV_READ | EV_WRITE))) {
+    ev_io_stop(l, io);
+    ev_io_set(io, io->fd, again);
+    ev_io_start(l, io);
+  }
+}
+
+static void reactor_wakeup(struct ev_loop *l, ev_async *a, int revents) {
+  lc_spin_lock(pending_lock);
+  lc_watch_t *start = starting;
+  lc_watch_t *cancel = cancelling;
+  close_req_t *close_reqs = closing;
+  starting = cancelling = NULL;
+  closing = NULL;
+  lc_spin_unlock(pending_lock);
+
+  // a watch is always queued to start before it can be cancelled
+  while (start) {
+    lc_watch_t *next = start->next_start;
+    watch_start(l, start);
+    start = next;
+  }
+
+  while (cancel) {
+    lc_watch_t *next = cancel->next_cancel;
+    if (ev_is_active(&cancel->io)) {
+      cancel->fn(cancel->io.fd, 0, cancel->data);
+      watch_stop(l, cancel);
+    }
+    watch_free(cancel);
+    cancel = next;
+  }
+
+  // libev mustn't be watching a descriptor when it is closed
+  while (close_reqs) {
+    close_req_t *next = close_reqs->next;
+    lc_watch_t *w = active;
+    while (w) {
+      lc_watch_t *next_w = w->next_active;
+      if (w->io.fd == close_reqs->fd) {
+        w->fn(w->io.fd, 0, w->data);
+        watch_stop(l, w);
+      }
+      w = next_w;
+    }
+    close_reqs->rc = close(close_reqs->fd);
+    lc_event_t *ev = close_reqs->ev;
+    atomic_int_set(&close_reqs->done, 1);
+    lc_event_notify(ev);
+    close_reqs = next;
+  }
+}
+
+static void reactor_thread(void *data) {
+  ev_run(loop, 0);
+}
+
+/*
+ * Starts the reactor for whichever thread needs it first, under pthread_once(), so the
+ * loop is only to be read once reactor_setup() has returned.
+ */
+static void reactor_init( ) {
+  pending_lock = lc_spin_new();
+  if (!pending_lock) return;
+  loop = ev_loop_new(EVFLAG_AUTO);
+  if (!loop) return;
+
+  ev_async_init(&wakeup, reactor_wakeup);
+  ev_async_start(loop, &wakeup);
+  if (lc_thread_start(reactor_thread, NULL) != SUCCESS) {
+    // nobody would ever run the loop, so don't take any watches
+    ev_async_stop(loop, &wakeup);
+    ev_loop_destroy(loop);
+    loop = NULL;
+    INFO("Unable to start the reactor thread");
+    return;
+  }
+  INFO("Initialized reactor");
+}
+
+static int reactor_setup( ) {
+  pthread_once(&reactor_once, reactor_init);
+  return loop ? SUCCESS : ERR_THREADFAIL;
+}
+
+/*
+ * Starts watching fd for events (LC_IO_READ and/or LC_IO_WRITE). The watch returned holds
+ * a reference for the caller, which has to be given back with lc_reactor_release().
+ */
+lc_watch_t *lc_reactor_watch(int fd, int events, reactor_fn fn, void *data) {
+  if (fd < 0 || !fn || !ev_events(events)) return NULL;
+  if (reactor_setup() != SUCCESS) return NULL;
+
+  lc_watch_t *w = lc_alloc(sizeof(lc_watch_t));
+  if (!w) return NULL;
+  memset(w, 0, sizeof(lc_watch_t));
+  ev_io_init(&w->io, watch_ready, fd, ev_events(events));
+  w->fn = fn;
+  w->data = data;
+  w->refs = 2;
+
+  lc_spin_lock(pending_lock);
+  w->next_start = starting;
+  starting = w;
+  lc_spin_unlock(pending_lock);
+  ev_async_send(loop, &wakeup);
+  return w;
+}
+
+// stops a watch that hasn't finished yet, its function sees the cancel as a call with no events
+int lc_reactor_cancel(lc_watch_t *w) {
+  // a watch was started, so the reactor is running
+  if (!w || reactor_setup() != SUCCESS) return ERR_INVAL;
+  atomic_ref_inc(&w->refs);
+  lc_spin_lock(pending_lock);
+  w->next_cancel = cancelling;
+  cancelling = w;
+  lc_spin_unlock(pending_lock);
+  ev_async_send(loop, &wakeup);
+  return SUCCESS;
+}
+
+void lc_reactor_release(lc_watch_t *w) {
+  if (w) watch_free(w);
+}
+
+int lc_reactor_nonblock(int fd) {
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) return FAIL;
+  if (flags & O_NONBLOCK) return SUCCESS;
+  if (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return FAIL;
+  return SUCCESS;
+}
+
+/*
+ * Closes fd on the reactor thread, once the watches on it have been stopped (each gets its
+ * last call, with no events), and returns what close() did.
+ */
+int lc_reactor_close(int fd) {
+  // without a reactor nothing can be watching fd
+  if (reactor_setup() != SUCCESS) return close(fd);
+
+  close_req_t req = { fd, 0, lc_event_local(), 0, NULL };
+  lc_spin_lock(pending_lock);
+  req.next = closing;
+  closing = &req;
+  lc_spin_unlock(pending_lock);
+  ev_async_send(loop, &wakeup);
+
+  while (!atomic_int_get(&req.done)) {
+    int key = lc_event_prepare(req.ev);
+    if (atomic_int_get(&req.done)) {
+      lc_event_cancel(req.ev);
+      break;
+    }
+    lc_event_wait(req.ev, key, -1);
+  }
+  return req.rc;
+}
+
+/*
+ * An I/O operation for Lua. It is tried straight away, and if the descriptor isn't ready a
+ * task waits for it on the reactor, which finishes the operation on its own thread and
+ * resumes the task with the results. Anything else blocks in poll(). An operation with a
+ * timeout races its timer to claim it; while the reactor is trying the descriptor the
+ * operation is busy, and the timer waits to see how that turns out.
+ */
+typedef enum {
+  IO_WAIT = 0, IO_READ, IO_WRITE
+} io_kind_t;
+
+typedef enum {
+  IO_IDLE = 0, IO_BUSY, IO_DONE
+} io_state_t;
+
+typedef struct _io_op {
+  task_id tid;
+  int kind;
+  int events;        // what to wait for, and for IO_WAIT what it found
+  int err;
+  char *buf;
+  size_t size;       // how much to read, or how much there is to write
+  size_t done;       // how much was read or written
+  lc_watch_t *watch;
+  lc_timer_t timer;
+  volatile int state;
+  volatile int refs; // the watch's, the timer's and one for whoever is setting it up
+} io_op_t;
+
+static void io_expired(void *data);
+
+static io_op_t *io_new(int kind, size_t size) {
+  io_op_t *op = lc_alloc(sizeof(io_op_t));
+  if (!op) return NULL;
+  memset(op, 0, sizeof(io_op_t));
+  op->kind = kind;
+  op->size = size;
+  op->refs = 1;
+  lc_timer_init(&op->timer, io_expired, op);
+  if (size > 0) {
+    op->buf = lc_alloc(size);
+    if (!op->buf) {
+      lc_free(op);
+      return NULL;
+    }
+  }
+  return op;
+}
+
+static void io_free(io_op_t *op) {
+  if (atomic_ref_dec(&op->refs) == 0) {
+    lc_reactor_release(op->watch);
+    if (op->buf) lc_free(op->buf);
+    lc_free(op);
+  }
+}
+
+// does as much of a read or write as fd allows, returning the events to wait for to go on
+static int io_attempt(io_op_t *op, int fd) {
+  for (;;) {
+    ssize_t n;
+    if (op->kind == IO_READ) {
+      n = read(fd, op->buf, op->size);
+      if (n >= 0) {
+        op->done = n;
+        return 0;
+      }
+    } else {
+      if (op->done == op->size) return 0;
+      n = write(fd, op->buf + op->done, op->size - op->done);
+      if (n >= 0) {
+        op->done += n;
+        continue;
+      }
+    }
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return op->kind == IO_READ ? LC_IO_READ : LC_IO_WRITE;
+    }
+    if (errno != EINTR) {
+      op->err = errno;
+      return 0;
+    }
+  }
+}
+
+static const char *io_mode(int events) {
+  switch (events & (LC_IO_READ | LC_IO_WRITE)) {
+    case LC_IO_READ | LC_IO_WRITE:
+      return "rw";
+    case LC_IO_READ:
+      return "r";
+    case LC_IO_WRITE:
+      return "w";
+  }
+  return "";
+}
+
+static const char *io_error(io_op_t *op) {
+  return op->err ? strerror(op->err) : "closed";
+}
+
+// the results of a finished operation, for a task
+static message_t *io_message(io_op_t *op, int timedout) {
+  message_builder_t mb;
+  msg_builder_init(&mb);
+  if (timedout || op->err || (op->kind == IO_READ && op->done == 0)) {
+    const char *reason = timedout ? "timeout" : io_error(op);
+    lc_pushnil(&mb);
+    lc_pushlstring(&mb, reason, strlen(reason));
+    if (op->kind == IO_WRITE) lc_pushnumber(&mb, op->done);
+  } else if (op->kind == IO_WAIT) {
+    const char *mode = io_mode(op->events);
+    lc_pushlstring(&mb, mode, strlen(mode));
+  } else if (op->kind == IO_READ) {
+    lc_pushlstring(&mb, op->buf, op->done);
+  } else {
+    lc_pushnumber(&mb, op->done);
+  }
+  return msg_new(&mb);
+}
+
+// the same results, for a caller that didn't have to wait or that waited in poll()
+static int io_push(lua_State *L, io_op_t *op, int timedout) {
+  if (timedout || op->err || (op->kind == IO_READ && op->done == 0)) {
+    lua_pushnil(L);
+    lua_pushstring(L, timedout ? "timeout" : io_error(op));
+    if (op->kind != IO_WRITE) return 2;
+    lua_pushnumber(L, op->done);
+    return 3;
+  } else if (op->kind == IO_WAIT) {
+    lua_pushstring(L, io_mode(op->events));
+  } else if (op->kind == IO_READ) {
+    lua_pushlstring(L, op->buf, op->done);
+  } else {
+    lua_pushnumber(L, op->done);
+  }
+  return 1;
+}
+
+static int io_ready(int fd, int events, void *data) {
+  io_op_t *op = (io_op_t *) data;
+  if (!atomic_int_cas(&op->state, IO_IDLE, IO_BUSY)) {
+    // the timer got there first, and cancelled the watch
+    io_free(op);
+    return 0;
+  }
+
+  if (!events) {
+    // the descriptor was closed from under the operation
+    op->err = EBADF;
+  } else if (op->kind == IO_WAIT) {
+    op->events = events;
+  } else {
+    int again = io_attempt(op, fd);
+    if (again) {
+      atomic_int_set(&op->state, IO_IDLE);
+      return again;
+    }
+  }
+
+  atomic_int_set(&op->state, IO_DONE);
+  if (lc_timer_cancel(&op->timer) == SUCCESS) {
+    io_free(op);
+  }
+  task_resume(op->tid, io_message(op, 0));
+  io_free(op);
+  return 0;
+}
+
+static void io_expired(void *data) {
+  io_op_t *op = (io_op_t *) data;
+  int state;
+  while ((state = atomic_int_get(&op->state)) != IO_DONE) {
+    if (state == IO_IDLE && atomic_int_cas(&op->state, IO_IDLE, IO_DONE)) {
+      task_resume(op->tid, io_message(op, 1));
+      lc_reactor_cancel(op->watch);
+      break;
+    }
+    cpu_relax();
+  }
+  io_free(op);
+}
+
+// waits for fd in poll(), for callers that aren't tasks
+static int io_block(lua_State *L, io_op_t *op, int fd, int events, lua_Number timeout) {
+  uint64_t deadline = timeout >= 0 ? lc_clock_usec() + (uint64_t) (timeout * 1000) : 0;
+  int timedout = 0;
+
+  while (events) {
+    int millis = -1;
+    if (timeout >= 0) {
+      uint64_t now = lc_clock_usec();
+      if (now >= deadline) {
+        timedout = 1;
+        break;
+      }
+      millis = (deadline - now + 999) / 1000;
+    }
+
+    struct pollfd p = { fd, 0, 0 };
+    if (events & LC_IO_READ) p.events |= POLLIN;
+    if (events & LC_IO_WRITE) p.events |= POLLOUT;
+    int rc = poll(&p, 1, millis);
+    if (rc < 0 && errno != EINTR) {
+      op->err = errno;
+      break;
+    }
+    if (rc <= 0) continue;
+
+    // errors and hangups count as ready, so that the read or write reports them
+    int ready = 0;
+    if (p.revents & (POLLIN | POLLHUP | POLLERR)) ready |= LC_IO_READ;
+    if (p.revents & (POLLOUT | POLLHUP | POLLERR)) ready |= LC_IO_WRITE;
+    if (op->kind == IO_WAIT) {
+      op->events = ready & events;
+      if (op->events) break;
+    } else if (ready & events) {
+      events = io_attempt(op, fd);
+    }
+  }
+
+  int count = io_push(L, op, timedout);
+  io_free(op);
+  return count;
+}
+
+// leaves the operation to the reactor and suspends the calling task, or blocks
+static int io_wait(lua_State *L, io_op_t *op, int fd, int events, lua_Number timeout) {
+  task_id tid = task_of(L);
+  if (!tid) return io_block(L, op, fd, events, timeout);
+
+  op->tid = tid;
+  op->events = events;
+  op->refs = timeout >= 0 ? 3 : 2;
+  op->watch = lc_reactor_watch(fd, events, io_ready, op);
+  if (!op->watch) {
+    lc_free(op->buf);
+    lc_free(op);
+    return luaL_error(L, "Unable to watch descriptor %d", fd);
+  }
+  if (timeout >= 0 && lc_timer_start(&op->timer, (long) timeout) != SUCCESS) {
+    io_free(op);
+  }
+  io_free(op);
+  return lua_yield(L, 0);
+}
+
+// a descriptor, given either as a number or as a Lua file
+static int check_fd(lua_State *L, int idx) {
+  if (lua_type(L, idx) == LUA_TNUMBER) {
+    return lua_tointeger(L, idx);
+  }
+  FILE **f = (FILE **) luaL_checkudata(L, idx, LUA_FILEHANDLE);
+  if (!*f) luaL_argerror(L, idx, "file is closed");
+  return fileno(*f);
+}
+
+/*
+ * A descriptor to read or write. A blocking one would hold up a pool thread in read() or
+ * write() until it was ready, but making it non-blocking here would change it for everyone
+ * sharing it (stdin and stdout included), so that is left to IO.nonblock().
+ */
+static int check_io_fd(lua_State *L, int idx) {
+  int fd = check_fd(L, idx);
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0) {
+    luaL_argerror(L, idx, strerror(errno));
+  }
+  if (!(flags & O_NONBLOCK)) {
+    luaL_argerror(L, idx, "descriptor is blocking, see IO.nonblock()");
+  }
+  return fd;
+}
+
+static int check_events(lua_State *L, int idx) {
+  const char *mode = luaL_optstring(L, idx, "r");
+  int events = 0;
+  if (strchr(mode, 'r')) events |= LC_IO_READ;
+  if (strchr(mode, 'w')) events |= LC_IO_WRITE;
+  luaL_argcheck(L, events, idx, "mode should be \"r\", \"w\" or \"rw\"");
+  return events;
+}
+
+/*
+ * IO.wait(fd, mode, timeout) waits until fd is ready for reading ("r", the default),
+ * writing ("w") or either ("rw"), and returns which. Times are in milliseconds.
+ */
+static int luaI_wait(lua_State *L) {
+  int fd = check_fd(L, 1);
+  int events = check_events(L, 2);
+  lua_Number timeout = luaL_optnumber(L, 3, -1);
+
+  io_op_t *op = io_new(IO_WAIT, 0);
+  if (!op) return luaL_error(L, "Unable to wait. Insufficient memory ?");
+  return io_wait(L, op, fd, events, timeout);
+}
+
+/*
+ * IO.read(fd, size, timeout) returns what it could read from fd, up to size bytes, once
+ * there is something to read. It returns nil, "closed" at the end of the file.
+ */
+static int luaI_read(lua_State *L) {
+  int fd = check_io_fd(L, 1);
+  int size = luaL_optint(L, 2, IO_READ_SIZE);
+  lua_Number timeout = luaL_optnumber(L, 3, -1);
+  luaL_argcheck(L, size > 0 && size <= IO_READ_MAX, 2, "invalid read size");
+
+  io_op_t *op = io_new(IO_READ, size);
+  if (!op) return luaL_error(L, "Unable to read. Insufficient memory ?");
+  int events = io_attempt(op, fd);
+  if (!events) {
+    int count = io_push(L, op, 0);
+    io_free(op);
+    return count;
+  }
+  return io_wait(L, op, fd, events, timeout);
+}
+
+/*
+ * IO.write(fd, data, timeout) writes all of data to fd, waiting for it to drain as often
+ * as it has to, and returns the number of bytes written. On failure it returns nil, the
+ * reason and how much was written.
+ */
+static int luaI_write(lua_State *L) {
+  int fd = check_io_fd(L, 1);
+  size_t len;
+  const char *data = luaL_checklstring(L, 2, &len);
+  lua_Number timeout = luaL_optnumber(L, 3, -1);
+
+  io_op_t *op = io_new(IO_WRITE, len);
+  if (!op) return luaL_error(L, "Unable to write. Insufficient memory ?");
+  if (len) memcpy(op->buf, data, len);
+  int events = io_attempt(op, fd);
+  if (!events) {
+    int count = io_push(L, op, 0);
+    io_free(op);
+    return count;
+  }
+  return io_wait(L, op, fd, events, timeout);
+}
+
+static int push_pair(lua_State *L, int fds[2]) {
+  lc_reactor_nonblock(fds[0]);
+  lc_reactor_nonblock(fds[1]);
+  lua_pushinteger(L, fds[0]);
+  lua_pushinteger(L, fds[1]);
+  return 2;
+}
+
+// IO.pipe() returns the non-blocking read and write ends of a new pipe
+static int luaI_pipe(lua_State *L) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return luaL_error(L, "Unable to create pipe: %s", strerror(errno));
+  }
+  return push_pair(L, fds);
+}
+
+// IO.socketpair() returns a pair of connected, non-blocking local stream sockets
+static int luaI_socketpair(lua_State *L) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+    return luaL_error(L, "Unable to create sockets: %s", strerror(errno));
+  }
+  return push_pair(L, fds);
+}
+
+// IO.nonblock(fd) puts a descriptor from elsewhere into the non-blocking mode IO.read() and
+// IO.write() need
+static int luaI_nonblock(lua_State *L) {
+  int fd = check_fd(L, 1);
+  if (lc_reactor_nonblock(fd) != SUCCESS) {
+    return luaL_error(L, "Unable to make descriptor %d non-blocking", fd);
+  }
+  return 0;
+}
+
+// IO.close(fd) closes a descriptor, failing whatever is waiting on it
+static int luaI_close(lua_State *L) {
+  int fd = luaL_checkint(L, 1);
+  lua_pushboolean(L, lc_reactor_close(fd) == 0);
+  return 1;
+}
+
+static const luaL_Reg funcs[] = { { "wait", luaI_wait },
+                                  { "read", luaI_read },
+                                  { "write", luaI_write },
+                                  { "pipe", luaI_pipe },
+                                  { "socketpair", luaI_socketpair },
+                                  { "nonblock", luaI_nonblock },
+                                  { "close", luaI_close },
+                                  { NULL, NULL } };
+
+int lc_open_io(lua_State *L) {
+  lua_newtable(L); // [tbl]
+  luaL_register(L, NULL, funcs); // [tbl]
+  return 0;
+}
@@ -0,0 +1,28 @@
+#ifndef __LC_REACTOR_H__
+#define __LC_REACTOR_H__
+
+#include "casting.h"
+
+/*
+ * The reactor is a libev loop on a thread of its own, which watches file descriptors for
+ * the rest of the library. A watch calls its function on the reactor thread when the
+ * descriptor is ready, and the function returns the events to carry on watching for, or
+ * zero once it is done. A cancelled watch gets one last call, with no events, and so do
+ * the watches on a descriptor closed with lc_reactor_close().
+ */
+#define LC_IO_READ        0x01
+#define LC_IO_WRITE       0x02
+
+#define IO_READ_SIZE      4096
+#define IO_READ_MAX       (1024 * 1024)
+
+typedef struct _lc_watch lc_watch_t;
+typedef int (*reactor_fn)(int fd, int events, void *data);
+
+lc_watch_t *lc_reactor_watch(int fd, int events, reactor_fn fn, void *data);
+int lc_reactor_cancel(lc_watch_t *w);
+void lc_reactor_release(lc_watch_t *w);
+int lc_reactor_nonblock(int fd);
+int lc_reactor_close(int fd);
+
+#endif // __LC_REACTOR_H__
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "casting.h"
+#include "lc_thread.h"
+#include "lc_ring.h"
+
+/*
+ * A cell's sequence is 2 * pos while it waits for the push at pos and 2 * pos + 1 for the
+ * pop, so the two turns can't be mistaken for each other even in a ring of one.
+ */
+typedef struct _ring_cell {
+  volatile uint64_t seq;
+  void *data;
+} ring_cell_t;
+
+/*
+ * The two positions sit on lines of their own, so producers and consumers don't share one.
+ * A single producer or consumer keeps its copy of the other side's position on its own line
+ * too, and only reads the real one when the copy says the ring is full or empty.
+ */
+struct _lc_ring {
+  int capacity;
+  int flags;
+  ring_cell_t *cells;
+  char pad0[CACHE_LINE];
+  volatile uint64_t write_pos;
+  uint64_t read_cached;
+  char pad1[CACHE_LINE];
+  volatile uint64_t read_pos;
+  uint64_t write_cached;
+  char pad2[CACHE_LINE];
+};
+
+lc_ring_t *lc_ring_new(int capacity, int flags) {
+  if (capacity <= 0) return NULL;
+
+  lc_ring_t *r = lc_alloc(sizeof(lc_ring_t));
+  if (!r) return NULL;
+  memset(r, 0, sizeof(lc_ring_t));
+
+  r->cells = lc_alloc(sizeof(ring_cell_t) * capacity);
+  if (!r->cells) {
+    lc_free(r);
+    return NULL;
+  }
+  for (int i = 0; i < capacity; i++) {
+    r->cells[i].seq = 2 * (uint64_t) i;
+    r->cells[i].data = NULL;
+  }
+  r->capacity = capacity;
+  r->flags = flags;
+  return r;
+}
+
+// frees the ring, handing whatever is still in it to rel (if given)
+void lc_ring_free(lc_ring_t *r, release_cb rel) {
+  if (!r) return;
+  void *p;
+  while ((p = lc_ring_pop(r))) {
+    if (rel) rel(p);
+  }
+  lc_free(r->cells);
+  lc_free(r);
+}
+
+// a single producer owns write_pos, so only has to publish it after filling in the cell
+static int spsc_push(lc_ring_t *r, void *p) {
+  uint64_t pos = r->write_pos;
+  if (pos - r->read_cached >= (uint64_t) r->capacity) {
+    r->read_cached = atomic_u64_get_acquire(&r->read_pos);
+    if (pos - r->read_cached >= (uint64_t) r->capacity) return ERR_FULL;
+  }
+  r->cells[pos % r->capacity].data = p;
+  atomic_u64_set_release(&r->write_pos, pos + 1);
+  return SUCCESS;
+}
+
+static void *spsc_pop(lc_ring_t *r) {
+  uint64_t pos = r->read_pos;
+  if (pos == r->write_cached) {
+    r->write_cached = atomic_u64_get_acquire(&r->write_pos);
+    if (pos == r->write_cached) return NULL;
+  }
+  void *p = r->cells[pos % r->capacity].data;
+  atomic_u64_set_release(&r->read_pos, pos + 1);
+  return p;
+}
+
+// returns ERR_FULL when there is no room, p can't be NULL
+int lc_ring_push(lc_ring_t *r, void *p) {
+  if (!r || !p) return ERR_INVAL;
+  if (r->flags & RING_SPSC) return spsc_push(r, p);
+
+  uint64_t pos = atomic_u64_get_acquire(&r->write_pos);
+  for (;;) {
+    ring_cell_t *cell = &r->cells[pos % r->capacity];
+    int64_t diff = (int64_t) (atomic_u64_get_acquire(&cell->seq) - 2 * pos);
+    if (diff == 0) {
+      if (atomic_u64_cas(&r->write_pos, pos, pos + 1)) {
+        cell->data = p;
+        atomic_u64_set_release(&cell->seq, 2 * pos + 1);
+        return SUCCESS;
+      }
+    } else if (diff < 0) {
+      // the cell still holds the message from a lap ago
+      return ERR_FULL;
+    }
+    pos = atomic_u64_get_acquire(&r->write_pos);
+  }
+}
+
+// returns NULL when the ring is empty
+void *lc_ring_pop(lc_ring_t *r) {
+  if (!r) return NULL;
+  if (r->flags & RING_SPSC) return spsc_pop(r);
+
+  uint64_t pos = atomic_u64_get_acquire(&r->read_pos);
+  for (;;) {
+    ring_cell_t *cell = &r->cells[pos % r->capacity];
+    int64_t diff = (int64_t) (atomic_u64_get_acquire(&cell->seq) - (2 * pos + 1));
+    if (diff == 0) {
+      if (atomic_u64_cas(&r->read_pos, pos, pos + 1)) {
+        void *p = cell->data;
+        atomic_u64_set_release(&cell->seq, 2 * (pos + r->capacity));
+        return p;
+      }
+    } else if (diff < 0) {
+      return NULL;
+    }
+    pos = atomic_u64_get_acquire(&r->read_pos);
+  }
+}
+
+// only a snapshot while others are pushing and popping
+int lc_ring_count(lc_ring_t *r) {
+  if (!r) return 0;
+  uint64_t read_pos = atomic_u64_get_acquire(&r->read_pos);
+  uint64_t write_pos = atomic_u64_get_acquire(&r->write_pos);
+  if (write_pos <= read_pos) return 0;
+  uint64_t count = write_pos - read_pos;
+  return count > (uint64_t) r->capacity ? r->capacity : (int) count;
+}
+
+int lc_ring_capacity(lc_ring_t *r) {
+  return r ? r->capacity : 0;
+}
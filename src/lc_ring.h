@@ -0,0 +1,30 @@
+#ifndef __LC_RING_H__
+#define __LC_RING_H__
+
+#include <stdint.h>
+#include "lc_error.h"
+#include "algorithm.h"
+
+/*
+ * A bounded ring of pointers that any number of threads can push to and pop from without a
+ * lock (Vyukov's MPMC queue). Each cell carries a sequence number saying whose turn it is:
+ * a producer claims a position by moving the write position on, fills in its cell and then
+ * hands the cell to the consumer of that position through the sequence, and likewise the
+ * other way round. Neither side ever waits for the other, a full or empty ring just says so.
+ *
+ * A RING_SPSC ring is for exactly one producer and one consumer at a time (one after the
+ * other on different threads is fine). It skips the sequences and CAS altogether: each side
+ * owns its position and publishes it with a plain release store.
+ */
+#define RING_SPSC   0x01
+
+typedef struct _lc_ring lc_ring_t;
+
+lc_ring_t *lc_ring_new(int capacity, int flags);
+void lc_ring_free(lc_ring_t *r, release_cb rel);
+int lc_ring_push(lc_ring_t *r, void *p);
+void *lc_ring_pop(lc_ring_t *r);
+int lc_ring_count(lc_ring_t *r);
+int lc_ring_capacity(lc_ring_t *r);
+
+#endif // __LC_RING_H__
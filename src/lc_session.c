@@ -1,22 +1,71 @@
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
 #include "casting.h"
 #include "lc_thread.h"
-#include "map.h"
 #include "queue.h"
 #include "lc_session.h"
+#include "lc_arena.h"
 #include "message.h"
 #include "lc_channel.h"
 
 static lc_threadpool_t *pool;
 static lc_local_t *task_key;
-static lc_spin_t *lock;
-static map_t *sessions;
+static lc_handles_t *sessions;
+static int quantum_jobs = SESSION_QUANTUM_JOBS;
+static int quantum_usec = SESSION_QUANTUM_USEC;
+
+/*
+ * Ready to use states, kept topped up to states_target by a background pool job. Each one
+ * keeps the NUMA node it was created on, which is where most of its memory lives.
+ */
+typedef struct _pooled_state {
+  lua_State *L;
+  int node;
+} pooled_state_t;
+
+static lc_spin_t *states_lock;
+static pooled_state_t states[STATE_POOL_MAX];
+static int nstates = 0;
+static int states_target = STATE_POOL_SIZE;
+static volatile int refilling = 0;
+static lc_job_t refill_job;
+
+// garbage collection of idle sessions, see session_gc()
+static int gc_step_kb = SESSION_GC_STEP;
+static int gc_slice_usec = SESSION_GC_SLICE;
+static int gc_idle_millis = SESSION_GC_IDLE;
+static lc_spin_t *idle_lock;
+static session_t *idle_sessions = NULL;
+static volatile uint64_t last_trim = 0;
+
+/*
+ * The idle list doesn't hold references, a session takes itself off it when it goes. The
+ * list and each session's place on it are guarded by idle_lock, which nests inside the
+ * session lock.
+ */
+static void idle_unlink(session_t *s) {
+  if (s->idle_prev) {
+    s->idle_prev->idle_next = s->idle_next;
+  } else {
+    idle_sessions = s->idle_next;
+  }
+  if (s->idle_next) s->idle_next->idle_prev = s->idle_prev;
+  s->idle_next = s->idle_prev = NULL;
+  s->idle = 0;
+}
+
+static lua_State *state_take(int *node);
+static void state_return(lua_State *L, int node, int reuse);
+static void session_gc_due(void *data);
 
 typedef struct _job {
   task_id tid;
@@ -38,57 +87,27 @@ static void rel_job(void *d) {
 
 int session_close(session_id);
 
-static int cmp_session(const void *a, const void *b) {
-  int a_id = ((session_t *) a)->id;
-  int b_id = ((session_t *) b)->id;
-  return a_id == b_id ? 0 : a_id > b_id ? 1 : -1;
-}
-
-static int dup_session(const void *a, void **n) {
-  session_t *d = (session_t *) lc_alloc(sizeof(session_t));
-  if (d) {
-    memcpy(d, a, sizeof(session_t));
+// called by the handle table once the last reference to the session has gone
+static void session_destroy(void *d) {
+  session_t *s = (session_t *) d;
+  if (s->idle) {
+    lc_spin_lock(idle_lock);
+    if (s->idle) idle_unlink(s);
+    lc_spin_unlock(idle_lock);
   }
-  *n = d;
-  return 0;
-}
-
-static void rel_session(void *d) {
-  lc_free(d);
+  lc_sem_destroy(s->sem);
+  lc_spin_destroy(s->lock);
+  queue_free(s->tasks);
+  state_return(s->state, s->node, !s->failed);
+  lc_free(s);
 }
 
 static session_t *session_ref(session_id sid) {
-  session_t f = { sid };
-  lc_spin_lock(lock);
-  session_t *s = map_find(sessions, &f);
-  if (s) {
-    atomic_int_inc(&s->ref_count);
-  }
-  lc_spin_unlock(lock);
-
-  return s;
-}
-
-static session_t *session_free(session_id sid) {
-  session_t f = { sid };
-  do {
-    lc_spin_lock(lock);
-    session_t *s = map_find(sessions, &f);
-    if (s) {
-      if (atomic_int_dec(&s->ref_count) > 0) break;
-      map_remove(sessions, s);
-      lc_sem_destroy(s->sem);
-      lc_spin_destroy(s->lock);
-      queue_free(s->tasks);
-      lua_close(s->state);
-      lc_free(s);
-      //printf("Freed session <%f>\n",sid);
-    }
-  } while (0);
-
-  lc_spin_unlock(lock);
+  return lc_handle_ref(sessions, sid);
+}
 
-  return SUCCESS;
+static int session_free(session_id sid) {
+  return lc_handle_release(sessions, sid);
 }
 
 static void registerlib(lua_State *L, const char *name, lua_CFunction f) {
@@ -117,31 +136,371 @@ static void openlibs(lua_State *L) {
   registerlib(L, "debug", luaopen_debug);
 }
 
-session_id session_new( ) {
-  static session_id next = 0;
-
-  session_t s = { };
-  do {
-    s.ref_count = 1;
-    s.status = ready;
-    s.state = luaL_newstate();
-    openlibs(s.state);
-    if (!s.state) {
+/*
+ * A pooled state remembers what it looked like when it was created: the contents of the
+ * globals, of package.loaded and package.preload, of every library table loaded and of the
+ * registry and the tables in it, all kept in the registry keyed by the table they came
+ * from. It also remembers the metatables of those tables and the metatables shared by all
+ * values of a type (such as the strings'). Resetting the state puts all of that back the
+ * way it was, which drops whatever a session added or replaced.
+ */
+static char snapshot_key;
+
+#define SNAP_SIZE     1   // how big the state was
+#define SNAP_METAS    2   // metatables, by table or by type, false for none
+#define SNAP_GLOBALS  3   // the globals table itself, in case it was replaced
+
+static const int shared_types[] = { LUA_TNIL, LUA_TBOOLEAN, LUA_TLIGHTUSERDATA, LUA_TNUMBER,
+                                    LUA_TSTRING, LUA_TFUNCTION, LUA_TTHREAD };
+
+static int sample_function(lua_State *L) {
+  return 0;
+}
+
+// a value of the type, to get at the metatable it shares with the rest of them
+static void push_sample(lua_State *L, int type) {
+  switch (type) {
+    case LUA_TBOOLEAN:
+      lua_pushboolean(L, 0);
+      break;
+    case LUA_TLIGHTUSERDATA:
+      lua_pushlightuserdata(L, &snapshot_key);
+      break;
+    case LUA_TNUMBER:
+      lua_pushnumber(L, 0);
+      break;
+    case LUA_TSTRING:
+      lua_pushliteral(L, "");
       break;
+    case LUA_TFUNCTION:
+      lua_pushcfunction(L, sample_function);
+      break;
+    case LUA_TTHREAD:
+      lua_pushthread(L);
+      break;
+    default:
+      lua_pushnil(L);
+      break;
+  }
+}
+
+// copies the fields of the table at idx into a new table on the top of the stack
+static void table_copy(lua_State *L, int idx) {
+  lua_newtable(L); // [copy]
+  lua_pushnil(L); // [copy][nil]
+  while (lua_next(L, idx)) { // [copy][k][v]
+    lua_pushvalue(L, -2); // [copy][k][v][k]
+    lua_insert(L, -2); // [copy][k][k][v]
+    lua_rawset(L, -4); // [copy][k]
+  }
+}
+
+// makes the table at idx hold exactly the fields of the copy at the top of the stack
+static void table_restore(lua_State *L, int idx) {
+  int copy = lua_gettop(L);
+  lua_pushnil(L); // [copy][nil]
+  while (lua_next(L, idx)) { // [copy][k][v]
+    lua_pop(L, 1); // [copy][k]
+    lua_pushvalue(L, -1); // [copy][k][k]
+    lua_rawget(L, copy); // [copy][k][orig]
+    if (lua_isnil(L, -1)) {
+      // clearing a field while traversing is allowed, adding one isn't
+      lua_pushvalue(L, -2); // [copy][k][nil][k]
+      lua_pushnil(L); // [copy][k][nil][k][nil]
+      lua_rawset(L, idx); // [copy][k][nil]
+    }
+    lua_pop(L, 1); // [copy][k]
+  }
+  lua_pushnil(L); // [copy][nil]
+  while (lua_next(L, copy)) { // [copy][k][v]
+    lua_pushvalue(L, -2); // [copy][k][v][k]
+    lua_insert(L, -2); // [copy][k][k][v]
+    lua_rawset(L, idx); // [copy][k]
+  }
+}
+
+// records the metatable of the table on the top of the stack, and pops the table
+static void snapshot_meta(lua_State *L, int snap) {
+  int tbl = lua_gettop(L);
+  lua_rawgeti(L, snap, SNAP_METAS); // [tbl][metas]
+  lua_pushvalue(L, tbl); // [tbl][metas][tbl]
+  if (!lua_getmetatable(L, tbl)) lua_pushboolean(L, 0); // [tbl][metas][tbl][meta]
+  lua_rawset(L, -3); // [tbl][metas]
+  lua_pop(L, 2);
+}
+
+static void snapshot_table(lua_State *L, int snap, int idx) {
+  lua_pushvalue(L, idx); // [tbl]
+  table_copy(L, lua_gettop(L)); // [tbl][copy]
+  lua_rawset(L, snap); // []
+  lua_pushvalue(L, idx); // [tbl]
+  snapshot_meta(L, snap); // []
+}
+
+static int state_snapshot(lua_State *L) {
+  lua_newtable(L); // [snap]
+  int snap = lua_gettop(L);
+  lua_newtable(L);
+  lua_rawseti(L, snap, SNAP_METAS);
+  lua_pushvalue(L, LUA_GLOBALSINDEX);
+  lua_rawseti(L, snap, SNAP_GLOBALS);
+  lua_pushlightuserdata(L, &snapshot_key);
+  lua_pushvalue(L, snap);
+  lua_rawset(L, LUA_REGISTRYINDEX);
+
+  snapshot_table(L, snap, LUA_GLOBALSINDEX);
+
+  lua_getglobal(L, "package"); // [snap][package]
+  lua_getfield(L, -1, "preload"); // [snap][package][preload]
+  snapshot_table(L, snap, lua_gettop(L));
+  lua_getfield(L, -2, "loaded"); // [snap][package][preload][loaded]
+  int loaded = lua_gettop(L);
+  snapshot_table(L, snap, loaded);
+  lua_pushnil(L);
+  while (lua_next(L, loaded)) { // [snap][package][preload][loaded][k][v]
+    if (lua_istable(L, -1) && !lua_rawequal(L, -1, loaded)) {
+      snapshot_table(L, snap, lua_gettop(L));
+    }
+    lua_pop(L, 1);
+  }
+  lua_pop(L, 3); // [snap]
+
+  // the registry, and the tables in it such as the metatables of the casting types
+  snapshot_table(L, snap, LUA_REGISTRYINDEX);
+  lua_pushnil(L);
+  while (lua_next(L, LUA_REGISTRYINDEX)) { // [snap][k][v]
+    if (lua_istable(L, -1) && !lua_rawequal(L, -1, snap)) {
+      lua_pushvalue(L, -1); // [snap][k][v][v]
+      lua_rawget(L, snap); // [snap][k][v][copy]
+      if (lua_isnil(L, -1)) snapshot_table(L, snap, lua_gettop(L) - 1);
+      lua_pop(L, 1); // [snap][k][v]
+    }
+    lua_pop(L, 1); // [snap][k]
+  }
+
+  for (int i = 0; i < sizeof(shared_types) / sizeof(shared_types[0]); i++) {
+    lua_pushnumber(L, shared_types[i]); // [snap][type]
+    push_sample(L, shared_types[i]); // [snap][type][sample]
+    if (lua_getmetatable(L, -1)) { // [snap][type][sample][meta]
+      snapshot_table(L, snap, lua_gettop(L));
+      lua_pop(L, 1);
+    }
+    lua_remove(L, -2); // [snap][sample]
+    lua_rawgeti(L, snap, SNAP_METAS); // [snap][sample][metas]
+    lua_pushnumber(L, shared_types[i]); // [snap][sample][metas][type]
+    if (!lua_getmetatable(L, -3)) lua_pushboolean(L, 0); // [snap][sample][metas][type][meta]
+    lua_rawset(L, -3); // [snap][sample][metas]
+    lua_pop(L, 2); // [snap]
+  }
+
+  // remember how big the state started out, so bloated ones aren't kept
+  lua_gc(L, LUA_GCCOLLECT, 0);
+  lua_pushnumber(L, lua_gc(L, LUA_GCCOUNT, 0));
+  lua_rawseti(L, snap, SNAP_SIZE);
+  lua_pop(L, 1);
+  return 0;
+}
+
+static int state_reset(lua_State *L) {
+  lua_settop(L, 0);
+  lua_sethook(L, NULL, 0, 0);
+  lua_pushlightuserdata(L, &snapshot_key);
+  lua_rawget(L, LUA_REGISTRYINDEX); // [snap]
+  lua_rawgeti(L, 1, SNAP_GLOBALS); // [snap][globals]
+  lua_replace(L, LUA_GLOBALSINDEX); // [snap]
+  lua_pushnil(L); // [snap][nil]
+  while (lua_next(L, 1)) { // [snap][tbl][copy]
+    if (lua_istable(L, -2)) {
+      table_restore(L, 2);
+    }
+    lua_pop(L, 1); // [snap][tbl]
+  }
+
+  lua_rawgeti(L, 1, SNAP_METAS); // [snap][metas]
+  lua_pushnil(L); // [snap][metas][nil]
+  while (lua_next(L, 2)) { // [snap][metas][key][meta]
+    if (lua_isnumber(L, -2)) {
+      push_sample(L, lua_tointeger(L, -2)); // [snap][metas][key][meta][sample]
+    } else {
+      lua_pushvalue(L, -2); // [snap][metas][key][meta][tbl]
+    }
+    if (lua_istable(L, -2)) {
+      lua_pushvalue(L, -2);
     } else {
-      // TODO this should be optional
-      openlibs(s.state);
-      s.lock = lc_spin_new();
-      s.sem = lc_sem_new(0);
-      s.tasks = queue_new(dup_job, rel_job);
+      lua_pushnil(L);
+    } // [snap][metas][key][meta][value][meta or nil]
+    lua_setmetatable(L, -2);
+    lua_pop(L, 2); // [snap][metas][key]
+  }
+  lua_pop(L, 1); // [snap]
+
+  lua_rawgeti(L, 1, SNAP_SIZE); // [snap][size]
+  int size = lua_tointeger(L, -1);
+  lua_settop(L, 0);
+  lua_gc(L, LUA_GCCOLLECT, 0);
+
+  lua_pushboolean(L, lua_gc(L, LUA_GCCOUNT, 0) <= size * STATE_POOL_GROWTH);
+  return 1;
+}
+
+static lc_arena_t *state_arena(lua_State *L) {
+  void *ud;
+  return lua_getallocf(L, &ud) == lc_arena_alloc ? (lc_arena_t *) ud : NULL;
+}
+
+static void state_close(lua_State *L) {
+  lc_arena_t *arena = state_arena(L);
+  lua_close(L);
+  lc_arena_free(arena);
+}
+
+/*
+ * An error outside any protected call ends up here, and Lua exits once this returns. As
+ * with luaL_newstate(), at least say why.
+ */
+static int state_panic(lua_State *L) {
+  fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+  return 0;
+}
+
+// every session state gets an arena of its own, see lc_arena.h
+static lua_State *state_new(int *node) {
+  *node = lc_threadpool_current_node(pool);
+  lc_arena_t *arena = lc_arena_new();
+  if (!arena) return NULL;
+  lua_State *L = lua_newstate(lc_arena_alloc, arena);
+  if (!L) {
+    lc_arena_free(arena);
+    return NULL;
+  }
+  lua_atpanic(L, state_panic);
+  openlibs(L);
+  if (lua_cpcall(L, state_snapshot, NULL) != 0) {
+    state_close(L);
+    return NULL;
+  }
+  return L;
+}
+
+static void state_refill(void *data) {
+  for (;;) {
+    lc_spin_lock(states_lock);
+    int wanted = nstates < states_target;
+    lc_spin_unlock(states_lock);
+    if (!wanted) break;
+
+    int node;
+    lua_State *L = state_new(&node);
+    if (!L) break;
+    state_return(L, node, 1);
+  }
+  atomic_int_set(&refilling, 0);
+}
+
+static void state_schedule_refill( ) {
+  if (!atomic_int_cas(&refilling, 0, 1)) return;
+  refill_job.fn = state_refill;
+  refill_job.prio = LC_PRIO_LOW;
+  refill_job.worker = 0;
+  lc_threadpool_submit(pool, &refill_job);
+}
+
+// hands out a pooled state if there is one, and tops the pool up once it runs low
+static lua_State *state_take(int *node) {
+  lua_State *L = NULL;
+  lc_spin_lock(states_lock);
+  if (nstates > 0) {
+    nstates--;
+    L = states[nstates].L;
+    *node = states[nstates].node;
+  }
+  int low = nstates <= states_target / 2;
+  lc_spin_unlock(states_lock);
+
+  if (low && states_target > 0) state_schedule_refill();
+  return L ? L : state_new(node);
+}
+
+/*
+ * Takes a state back from a session that has gone. It is reset and pooled again if the pool
+ * has room and it is safe to: reuse is 0 when one of the session's tasks ended in an error
+ * (which may have left changes half done), the reset has to go through, and the state must
+ * not have grown past STATE_POOL_GROWTH times its starting size. Otherwise it is closed.
+ */
+static void state_return(lua_State *L, int node, int reuse) {
+  if (!L) return;
+
+  if (reuse) {
+    lc_spin_lock(states_lock);
+    reuse = nstates < states_target;
+    lc_spin_unlock(states_lock);
+  }
+  if (reuse) {
+    lc_arena_set_limit(state_arena(L), 0);
+    lua_pushcfunction(L, state_reset);
+    reuse = lua_pcall(L, 0, 1, 0) == 0 && lua_toboolean(L, -1);
+    lua_settop(L, 0);
+  }
+  if (reuse) {
+    lc_spin_lock(states_lock);
+    if (nstates < states_target) {
+      states[nstates].L = L;
+      states[nstates++].node = node;
+      L = NULL;
     }
-    lc_spin_lock(lock);
-    s.id = ++next;
-    map_insert(sessions, &s);
-    lc_spin_unlock(lock);
-  } while (0);
+    lc_spin_unlock(states_lock);
+  }
+  if (L) state_close(L);
+}
+
+/*
+ * Sets how many ready to use states are kept for new sessions, up to STATE_POOL_MAX. States
+ * over the new size are closed, and the pool is filled up in the background.
+ */
+int session_set_states(int size) {
+  if (size < 0 || size > STATE_POOL_MAX) return ERR_INVAL;
+
+  lua_State *extra[STATE_POOL_MAX];
+  int nextra = 0;
+  lc_spin_lock(states_lock);
+  states_target = size;
+  while (nstates > size) {
+    extra[nextra++] = states[--nstates].L;
+  }
+  lc_spin_unlock(states_lock);
+
+  while (nextra > 0) {
+    state_close(extra[--nextra]);
+  }
+  if (size > 0) state_schedule_refill();
+  return SUCCESS;
+}
+
+int session_states( ) {
+  return nstates;
+}
+
+session_id session_new( ) {
+  session_t *s = lc_alloc(sizeof(session_t));
+  if (!s) return HANDLE_NONE;
+
+  memset(s, 0, sizeof(session_t));
+  s->status = ready;
+  // prefer running on the NUMA node the state was allocated on
+  s->state = state_take(&s->node);
+  if (!s->state) {
+    lc_free(s);
+    return HANDLE_NONE;
+  }
+  s->lock = lc_spin_new();
+  s->sem = lc_sem_new(0);
+  lc_timer_init(&s->gc_timer, session_gc_due, s);
+  s->tasks = queue_new(dup_job, rel_job);
+  s->prio = LC_PRIO_NORMAL;
 
-  return s.id;
+  s->id = lc_handle_new(sessions, s);
+  if (s->id == HANDLE_NONE) session_destroy(s);
+  return s->id;
 }
 
 lua_Session *get_session(lua_State *L, int idx) {
@@ -151,11 +510,11 @@ lua_Session *get_session(lua_State *L, int idx) {
 session_id lc_createsession(lua_State *L) {
 
   session_id sid = session_new();
-  if (sid > 0) {
+  if (sid != HANDLE_NONE) {
     lua_Session *ls = (lua_Session *) lua_newuserdata(L, sizeof(lua_Session)); // [session]
     if (!ls) {
       session_close(sid);
-      return FAIL;
+      return HANDLE_NONE;
     }
 
     ls->sid = sid;
@@ -166,31 +525,42 @@ session_id lc_createsession(lua_State *L) {
   return sid;
 }
 
+// drops the caller's reference, the session goes once whoever is using it has finished
 int session_close(session_id sid) {
-  session_t *s = session_free(sid);
-
-  if (s) {
-    // simply wait until whoever is using it has finished
-    lc_spin_lock(s->lock);
-    lc_spin_destroy(s->lock);
-    queue_free(s->tasks);
-    lua_close(s->state);
-  }
-  return SUCCESS;
+  return session_free(sid);
 }
 
 int session_wait(session_id sid) {
   session_t *s = session_ref(sid);
+  if (!s) return ERR_INVAL;
   lc_sem_wait(s->sem);
   session_free(sid);
   return SUCCESS;
 }
 
 static void session_thread(void *d) {
-  session_id sid = *(session_id *) d;
-  lc_free(d);
+  session_run((session_t *) d);
+}
 
-  session_run(sid);
+/*
+ * Hands the session to the threadpool, unless it is already waiting there or running. The
+ * pool job is embedded in the session and holds a reference to it until the session runs
+ * out of work. With a batch, the job is added to it for the caller to submit instead.
+ * Must be called with the session lock held.
+ */
+static void session_schedule(session_t *s, lc_job_t **batch, int *nbatch) {
+  if (s->scheduled) return;
+  s->scheduled = 1;
+  session_ref(s->id);
+  s->job.fn = session_thread;
+  s->job.data = s;
+  s->job.prio = s->prio;
+  if (batch) {
+    s->job.node = s->node;
+    batch[(*nbatch)++] = &s->job;
+  } else {
+    lc_threadpool_submit_node(pool, &s->job, s->node);
+  }
 }
 
 int session_queue_task(task_id tid, message_t *m) {
@@ -202,69 +572,362 @@ int session_queue_task(task_id tid, message_t *m) {
   if (!s) return ERR_INVAL;
 
   job_t job = { tid, m };
-  do {
+  lc_spin_lock(s->lock);
+  queue_push(s->tasks, &job);
+  session_schedule(s, NULL, NULL);
+  lc_spin_unlock(s->lock);
+
+  session_free(sid);
+
+  return SUCCESS;
+}
+
+/*
+ * Queues the same message to many tasks. The message is shared by reference, and sessions
+ * that need scheduling are handed to the pool in one batch instead of one wakeup each.
+ * Returns the number of tasks queued.
+ */
+int session_queue_tasks(task_id *tids, int count, message_t *m) {
+  lc_job_t *small[BATCH_SIZE];
+  lc_job_t **jobs = count > BATCH_SIZE ? lc_alloc(sizeof(lc_job_t *) * count) : small;
+  if (!jobs) return 0;
+
+  int queued = 0;
+  int njobs = 0;
+  for (int i = 0; i < count; i++) {
+    task_t *t = task_ref(tids[i]);
+    if (!t) continue;
+    session_id sid = t->sid;
+    session_t *s = session_ref(sid);
+    task_free(tids[i]);
+    if (!s) continue;
+
+    job_t job = { tids[i], m ? msg_ref(m) : NULL };
     lc_spin_lock(s->lock);
     queue_push(s->tasks, &job);
-    if (s->status != ready) break;
+    session_schedule(s, jobs, &njobs);
+    lc_spin_unlock(s->lock);
+
+    session_free(sid);
+    queued++;
+  }
+
+  lc_threadpool_submit_batch(pool, jobs, njobs);
+  if (jobs != small) lc_free(jobs);
+  return queued;
+}
+
+int session_set_priority(session_id sid, int prio) {
+  if (prio < 0 || prio >= POOL_CLASSES) return ERR_INVAL;
+  session_t *s = session_ref(sid);
+  if (!s) return ERR_INVAL;
 
-    session_id *psid = lc_alloc(sizeof(session_id));
-    *psid = sid;
-    lc_threadpool_run(pool, session_thread, psid);
-  } while (0);
+  lc_spin_lock(s->lock);
+  s->prio = prio;
   lc_spin_unlock(s->lock);
 
   session_free(sid);
+  return SUCCESS;
+}
+
+/*
+ * Sets how much a session may run per dispatch: up to jobs tasks, or until usec have
+ * passed, whichever comes first. A quantum of one job runs a single task per dispatch.
+ */
+int session_set_quantum(int jobs, int usec) {
+  if (jobs < 1 || usec < 0) return ERR_INVAL;
+  quantum_jobs = jobs;
+  quantum_usec = usec;
+  return SUCCESS;
+}
+
+/*
+ * Sets how long (in microseconds) a task of the session may run before it is preempted and
+ * queued behind the session's other tasks, zero to let tasks run until they yield.
+ */
+int session_set_timeslice(session_id sid, int usec) {
+  if (usec < 0) return ERR_INVAL;
+  session_t *s = session_ref(sid);
+  if (!s) return ERR_INVAL;
+  lc_spin_lock(s->lock);
+  s->timeslice = usec;
+  lc_spin_unlock(s->lock);
+  session_free(sid);
+  return SUCCESS;
+}
 
+/*
+ * Reports how busy a session is: the tasks it has waiting to run, counting one that is
+ * running, and how long its tasks have been running for lately. The numbers are a snapshot
+ * taken without the session lock, good enough for placing work.
+ */
+int session_load(session_id sid, int *pending, uint64_t *task_usec) {
+  session_t *s = session_ref(sid);
+  if (!s) return ERR_INVAL;
+  if (pending) *pending = queue_size(s->tasks) + (s->status == running);
+  if (task_usec) *task_usec = s->task_usec;
+  session_free(sid);
   return SUCCESS;
 }
 
-int session_run(session_id sid) {
+int session_set_memory_limit(session_id sid, size_t limit) {
   session_t *s = session_ref(sid);
   if (!s) return ERR_INVAL;
+  int rc = lc_arena_set_limit(state_arena(s->state), limit);
+  session_free(sid);
+  return rc;
+}
+
+int session_memory(session_id sid, size_t *live, size_t *peak, size_t *limit) {
+  session_t *s = session_ref(sid);
+  if (!s) return ERR_INVAL;
+  lc_arena_t *arena = state_arena(s->state);
+  *live = lc_arena_live(arena);
+  *peak = lc_arena_peak(arena);
+  *limit = lc_arena_limit(arena);
+  session_free(sid);
+  return SUCCESS;
+}
+
+/*
+ * Sessions collect their garbage while they have nothing else to do. Once a session has
+ * been out of work for SESSION_GC_DELAY millis (so sessions that are only idle between
+ * messages don't pay for it) it queues a low priority GC job, which runs incremental steps
+ * of at most gc_slice_usec at a time (requeueing itself between slices) until the collector
+ * finishes its cycle or the session gets work again. Sessions that stay idle also go on the
+ * idle list, and once they have been idle for gc_idle_millis the pool's idle hook has them
+ * do a full collect. After a full collect, malloc is asked to hand free memory back to the
+ * system, at most every SESSION_GC_TRIM millis since that goes through the whole process;
+ * the pages of the session arenas stay with their arenas.
+ *
+ * While collecting, the GC job marks the session scheduled, so that new work is queued
+ * rather than run alongside it. Must be called with the session lock held.
+ */
+static void session_gc(void *data);
+
+static void session_gc_schedule(session_t *s) {
+  if (s->gc_pending) return;
+  s->gc_pending = 1;
+  session_ref(s->id);
+  s->gc_job.fn = session_gc;
+  s->gc_job.data = s;
+  s->gc_job.prio = LC_PRIO_LOW;
+  lc_threadpool_submit_node(pool, &s->gc_job, s->node);
+}
+
+typedef struct _gc_run {
+  session_t *s;
+  int full;
+  uint64_t deadline;
+  int done;
+} gc_run_t;
+
+// collects under lua_cpcall(), since a __gc metamethod may raise an error
+static int gc_collect(lua_State *L) {
+  gc_run_t *run = (gc_run_t *) lua_touserdata(L, 1);
+  if (run->full) {
+    lua_gc(L, LUA_GCCOLLECT, 0);
+  } else if (gc_step_kb > 0) {
+    do {
+      run->done = lua_gc(L, LUA_GCSTEP, gc_step_kb);
+    } while (!run->done && queue_size(run->s->tasks) == 0 && lc_clock_usec() < run->deadline);
+  }
+  return 0;
+}
+
+static void gc_trim(uint64_t now) {
+#ifdef __GLIBC__
+  uint64_t last = atomic_u64_get_acquire(&last_trim);
+  if (now - last >= SESSION_GC_TRIM * 1000ULL && atomic_u64_cas(&last_trim, last, now)) {
+    malloc_trim(0);
+  }
+#endif
+}
+
+static void session_gc(void *data) {
+  session_t *s = (session_t *) data;
 
   lc_spin_lock(s->lock);
-  if (s->status == running) {
+  s->gc_pending = 0;
+  if (s->scheduled || queue_size(s->tasks) > 0) {
     lc_spin_unlock(s->lock);
-    session_free(sid);
-    return SUCCESS; // TODO ERR_RUNNING ??
+    session_free(s->id);
+    return;
   }
-
-  s->status = running;
-  job_t *job = queue_pop(s->tasks);
+  s->scheduled = 1;
+  uint64_t now = lc_clock_usec();
+  int full = gc_idle_millis > 0 && !s->collected
+      && now - s->idle_since >= gc_idle_millis * 1000ULL;
   lua_State *L = s->state;
   lc_spin_unlock(s->lock);
 
-  if (job) {
-    task_run(job->tid, L, job->message);
+  gc_run_t run = { s, full, now + gc_slice_usec, 1 };
+  if (lua_cpcall(L, gc_collect, &run) != 0) {
+    INFO("Error collecting garbage: %s", lua_tostring(L, -1));
+    lua_pop(L, 1);
+    run.done = 1;
+  }
+  if (full) gc_trim(now);
+  int done = run.done;
+
+  lc_spin_lock(s->lock);
+  s->scheduled = 0;
+  if (full) s->collected = 1;
+  if (queue_size(s->tasks) > 0) {
+    session_schedule(s, NULL, NULL);
+  } else if (!done) {
+    session_gc_schedule(s);
+  }
+  lc_spin_unlock(s->lock);
+  session_free(s->id);
+}
+
+// the GC delay timer, which holds a reference to the session
+static void session_gc_due(void *data) {
+  session_t *s = (session_t *) data;
+
+  lc_spin_lock(s->lock);
+  if (!s->scheduled && queue_size(s->tasks) == 0) {
+    // the session may have been busy and gone idle again since the timer was started
+    uint64_t idle = lc_clock_usec() - s->idle_since;
+    if (idle < SESSION_GC_DELAY * 1000ULL) {
+      if (lc_timer_start(&s->gc_timer, (SESSION_GC_DELAY * 1000ULL - idle + 999) / 1000)
+          == SUCCESS) {
+        lc_spin_unlock(s->lock);
+        return;
+      }
+    } else {
+      session_gc_schedule(s);
+    }
+  }
+  lc_spin_unlock(s->lock);
+  session_free(s->id);
+}
+
+// a session just ran out of work, must be called with the session lock held
+static void session_idle(session_t *s) {
+  s->idle_since = lc_clock_usec();
+  s->collected = 0;
+  // a timer that is already running picks up the new idle_since
+  session_ref(s->id);
+  if (lc_timer_start(&s->gc_timer, SESSION_GC_DELAY) != SUCCESS) session_free(s->id);
+  if (gc_idle_millis <= 0) return;
+
+  lc_spin_lock(idle_lock);
+  if (!s->idle) {
+    s->idle = 1;
+    s->idle_prev = NULL;
+    s->idle_next = idle_sessions;
+    if (idle_sessions) idle_sessions->idle_prev = s;
+    idle_sessions = s;
+  }
+  lc_spin_unlock(idle_lock);
+}
+
+// the pool's idle hook, which starts full collects on sessions idle for long enough
+static void session_sweep(void *data) {
+  if (gc_idle_millis <= 0 || !idle_sessions) return;
+  uint64_t now = lc_clock_usec();
+  session_t *due = NULL;
+
+  // take the sessions that have been idle long enough off the list, unless they're going
+  lc_spin_lock(idle_lock);
+  session_t *s = idle_sessions;
+  while (s) {
+    session_t *next = s->idle_next;
+    if (now - s->idle_since >= gc_idle_millis * 1000ULL && session_ref(s->id)) {
+      idle_unlink(s);
+      s->idle_next = due;
+      due = s;
+    }
+    s = next;
+  }
+  lc_spin_unlock(idle_lock);
+
+  while ((s = due)) {
+    due = s->idle_next;
+    s->idle_next = NULL;
+    lc_spin_lock(s->lock);
+    if (!s->scheduled && queue_size(s->tasks) == 0 && !s->collected) {
+      session_gc_schedule(s);
+    }
+    lc_spin_unlock(s->lock);
+    session_free(s->id);
+  }
+}
+
+/*
+ * Sets how idle sessions collect garbage: step_kb is the size of each incremental step,
+ * slice_usec bounds the steps taken per GC job, and a session idle for idle_millis does a
+ * full collect. A step of zero turns the incremental steps off, idle_millis of zero the
+ * full collects.
+ */
+int session_set_gc(int step_kb, int slice_usec, int idle_millis) {
+  if (step_kb < 0 || slice_usec < 0 || idle_millis < 0) return ERR_INVAL;
+  gc_step_kb = step_kb;
+  gc_slice_usec = slice_usec;
+  gc_idle_millis = idle_millis;
+  return SUCCESS;
+}
+
+int session_run(session_t *s) {
+  if (!s) return ERR_INVAL;
+
+  // run up to a quantum of jobs (or time) per dispatch, then go to the back of the pool's
+  // queue so the other sessions get their turn
+  int budget = quantum_jobs;
+  uint64_t start = lc_clock_usec();
+  uint64_t deadline = start + quantum_usec;
+  for (;;) {
+    lc_spin_lock(s->lock);
+    s->status = running;
+    job_t *job = queue_pop(s->tasks);
+    lua_State *L = s->state;
+    int slice = s->timeslice;
+    lc_spin_unlock(s->lock);
+
+    if (!job) break;
+    if (task_run(job->tid, L, job->message, slice) == ERR_BADSTATE) s->failed = 1;
     lc_free(job);
+
+    uint64_t now = lc_clock_usec();
+    s->task_usec = (s->task_usec * 7 + (now - start)) / 8;
+    start = now;
+    if (--budget <= 0 || now >= deadline) break;
   }
 
-  // resubmit the session to the threadpool if there are more jobs on the session to be run
+  // resubmit the session to the threadpool if there are more jobs on the session to be run,
+  // the pool job keeps its reference to the session in that case
+  int idle = 0;
   lc_spin_lock(s->lock);
   s->status = ready;
   if (queue_size(s->tasks) == 0) {
+    s->scheduled = 0;
+    idle = 1;
+    session_idle(s);
     lc_sem_post(s->sem); // let the world know we're ready for more !!
   } else {
-    session_id *psid = lc_alloc(sizeof(session_id));
-    *psid = sid;
-    lc_threadpool_run(pool, session_thread, psid);
+    lc_threadpool_submit_node(pool, &s->job, s->node);
   }
   lc_spin_unlock(s->lock);
   // finally, either unreference or destroy the session
-  session_free(sid);
+  if (idle) session_free(s->id);
   return SUCCESS;
 }
 
 static int luaS_newsession(lua_State *L) {
   session_id sid = lc_createsession(L);
-  if (sid < 1) {
+  if (sid == HANDLE_NONE) {
     return luaL_error(L, "Error creating session. Insufficient memory ?");
   }
   return 1;
 }
 
-static int luaS_createtask(lua_State *L) {
-  lua_Session *ls = get_session(L, 1);
+/*
+ * Starts a task in a session, running the function at index 2 with the values after it,
+ * and leaves the task on the stack.
+ */
+int lc_spawntask(lua_State *L, session_id sid) {
   int top = lua_gettop(L);
   luaL_checktype(L,2,LUA_TFUNCTION);
 
@@ -272,7 +935,7 @@ static int luaS_createtask(lua_State *L) {
   if (!m) {
     return luaL_error(L,"Unable to encode parameters");
   }
-  task_id tid = lc_createtask(L, ls->sid);
+  task_id tid = lc_createtask(L, sid);
   if (tid == 0) {
     return luaL_error(L,"Unable to create task");
   }
@@ -280,9 +943,38 @@ static int luaS_createtask(lua_State *L) {
   return 1;
 }
 
+static int luaS_createtask(lua_State *L) {
+  lua_Session *ls = get_session(L, 1);
+  return lc_spawntask(L, ls->sid);
+}
+
+static int luaS_resume_all(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int count = lua_objlen(L, 1);
+
+  // the ids live in a scratch userdata kept below the arguments, so a bad entry can raise
+  task_id *tids = (task_id *) lua_newuserdata(L, sizeof(task_id) * (count ? count : 1));
+  lua_insert(L, 2);
+  for (int i = 0; i < count; i++) {
+    lua_rawgeti(L, 1, i + 1);
+    tids[i] = ((lua_Task *) luaL_checkudata(L, -1, CASTING_TASK))->tid;
+    lua_pop(L, 1);
+  }
+
+  message_t *m = lua_newmessage(L, lua_gettop(L) - 2);
+  if (!m) {
+    return luaL_error(L, "Unable to encode parameters");
+  }
+  int n = task_resume_all(tids, count, m);
+  msg_destroy(m);
+  lua_pushinteger(L, n);
+  return 1;
+}
+
 static int luaS_close(lua_State *L) {
   lua_Session *ls = get_session(L, 1);
   session_close(ls->sid);
+  ls->sid = HANDLE_NONE;
   return 0;
 }
 
@@ -295,19 +987,249 @@ static int luas_wait(lua_State *L) {
 static int luaT_set_threads(lua_State *L) {
   int min = luaL_checkint(L, 1);
   int max = luaL_checkint(L, 2);
+  int delay = luaL_optint(L, 3, lc_threadpool_target_delay(pool));
+  int idle = luaL_optint(L, 4, lc_threadpool_idle_millis(pool));
 
   lc_threadpool_set_threads(pool, min, max);
+  if (lc_threadpool_set_targets(pool, delay, idle) != SUCCESS) {
+    return luaL_error(L, "Invalid queueing delay or idle timeout");
+  }
 
   return 0;
 }
 
+static int luaT_set_quantum(lua_State *L) {
+  int jobs = luaL_checkint(L, 1);
+  int usec = luaL_optint(L, 2, quantum_usec);
+
+  if (session_set_quantum(jobs, usec) != SUCCESS) {
+    return luaL_error(L, "Invalid run quantum");
+  }
+  return 0;
+}
+
+static int luaT_set_states(lua_State *L) {
+  int size = luaL_checkint(L, 1);
+  if (session_set_states(size) != SUCCESS) {
+    return luaL_error(L, "Invalid state pool size");
+  }
+  return 0;
+}
+
+static int luaT_states(lua_State *L) {
+  lua_pushnumber(L, session_states());
+  return 1;
+}
+
+/*
+ * Session.set_gc{ step = 16, slice = 500, idle = 5000 } tunes garbage collection of idle
+ * sessions, see session_set_gc().
+ */
+static int luaT_set_gc(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  lua_getfield(L, 1, "step"); // [step]
+  int step = luaL_optint(L, -1, gc_step_kb);
+  lua_getfield(L, 1, "slice"); // [step][slice]
+  int slice = luaL_optint(L, -1, gc_slice_usec);
+  lua_getfield(L, 1, "idle"); // [step][slice][idle]
+  int idle = luaL_optint(L, -1, gc_idle_millis);
+  lua_pop(L, 3); // []
+
+  if (session_set_gc(step, slice, idle) != SUCCESS) {
+    return luaL_error(L, "Invalid GC settings");
+  }
+  return 0;
+}
+
 static int luaT_threads(lua_State *L) {
   int min = lc_threadpool_min(pool);
   int max = lc_threadpool_max(pool);
 
   lua_pushnumber(L, min);
   lua_pushnumber(L, max);
-  return 2;
+  lua_pushnumber(L, lc_threadpool_target_delay(pool));
+  lua_pushnumber(L, lc_threadpool_idle_millis(pool));
+  return 4;
+}
+
+/*
+ * Session.stats() returns a table of pool counters, with times in microseconds and one
+ * entry in workers for each running pool thread.
+ */
+static int luaT_stats(lua_State *L) {
+  lc_pool_stats_t stats;
+  lc_threadpool_stats(pool, &stats);
+
+  lua_createtable(L, 0, 14); // [stats]
+  lua_pushnumber(L, stats.threads);
+  lua_setfield(L, -2, "threads");
+  lua_pushnumber(L, stats.idle);
+  lua_setfield(L, -2, "idle");
+  lua_pushnumber(L, stats.queued);
+  lua_setfield(L, -2, "queued");
+  lua_pushnumber(L, stats.executed);
+  lua_setfield(L, -2, "executed");
+  lua_pushnumber(L, stats.busy_usec);
+  lua_setfield(L, -2, "busy");
+  lua_pushnumber(L, stats.created);
+  lua_setfield(L, -2, "created");
+  lua_pushnumber(L, stats.retired);
+  lua_setfield(L, -2, "retired");
+  lua_pushnumber(L, stats.affinity_hits);
+  lua_setfield(L, -2, "affinity_hits");
+  lua_pushnumber(L, stats.affinity_misses);
+  lua_setfield(L, -2, "affinity_misses");
+  lua_pushnumber(L, stats.wait_p50);
+  lua_setfield(L, -2, "wait_p50");
+  lua_pushnumber(L, stats.wait_p90);
+  lua_setfield(L, -2, "wait_p90");
+  lua_pushnumber(L, stats.wait_p99);
+  lua_setfield(L, -2, "wait_p99");
+
+  lua_newtable(L); // [stats][workers]
+  int n = 0;
+  for (int i = 0; i < POOL_MAX_THREADS; i++) {
+    lc_worker_stats_t *ws = &stats.workers[i];
+    if (!ws->active) continue;
+    lua_createtable(L, 0, 5); // [stats][workers][worker]
+    lua_pushnumber(L, ws->queued);
+    lua_setfield(L, -2, "queued");
+    lua_pushnumber(L, ws->executed);
+    lua_setfield(L, -2, "executed");
+    lua_pushnumber(L, ws->busy_usec);
+    lua_setfield(L, -2, "busy");
+    lua_pushnumber(L, ws->affinity_hits);
+    lua_setfield(L, -2, "affinity_hits");
+    lua_pushnumber(L, ws->affinity_misses);
+    lua_setfield(L, -2, "affinity_misses");
+    lua_rawseti(L, -2, ++n); // [stats][workers]
+  }
+  lua_setfield(L, -2, "workers"); // [stats]
+  return 1;
+}
+
+/*
+ * Session.set_affinity{ cpus = { 0, 1, 2, 3 }, numa = true } places pool threads started
+ * from now on: each is pinned to one of the listed CPUs, and with numa they are grouped by
+ * node and sessions prefer threads on the node their state was created on.
+ */
+static int luaT_set_affinity(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int cpus[POOL_MAX_CPUS];
+  int ncpus = 0;
+
+  lua_getfield(L, 1, "cpus"); // [cpus]
+  if (lua_istable(L, -1)) {
+    int n = lua_objlen(L, -1);
+    for (int i = 1; i <= n && ncpus < POOL_MAX_CPUS; i++) {
+      lua_rawgeti(L, -1, i); // [cpus][cpu]
+      cpus[ncpus++] = luaL_checkint(L, -1);
+      lua_pop(L, 1); // [cpus]
+    }
+  }
+  lua_pop(L, 1); // []
+
+  lua_getfield(L, 1, "numa"); // [numa]
+  int numa = lua_toboolean(L, -1);
+  lua_pop(L, 1); // []
+
+  int rc = lc_threadpool_set_affinity(pool, cpus, ncpus, numa);
+  if (rc != SUCCESS) {
+    return luaL_error(L, "Unable to set thread affinity: %s", errmsg(rc));
+  }
+  lua_pushnumber(L, lc_threadpool_nodes(pool));
+  return 1;
+}
+
+static const char *const priorities[] = { "high", "normal", "low", NULL };
+static const char *const policies[] = { "strict", "weighted", NULL };
+
+/*
+ * session:set_priority("high" | "normal" | "low") sets the class the session is dispatched
+ * in from its next scheduling on.
+ */
+static int luas_set_priority(lua_State *L) {
+  lua_Session *ls = get_session(L, 1);
+  int prio = luaL_checkoption(L, 2, "normal", priorities);
+
+  if (session_set_priority(ls->sid, prio) != SUCCESS) {
+    return luaL_error(L, "Unable to set priority, session closed ?");
+  }
+  return 0;
+}
+
+/*
+ * Session.set_scheduling{ policy = "weighted", weights = { 16, 4, 1 }, starve = 50000 }
+ * chooses how the priority classes share the pool, see lc_threadpool_set_priority().
+ */
+static int luaT_set_scheduling(lua_State *L) {
+  luaL_checktype(L, 1, LUA_TTABLE);
+  int weights[POOL_CLASSES];
+  int *pw = NULL;
+
+  lua_getfield(L, 1, "policy"); // [policy]
+  int policy = luaL_checkoption(L, -1, "strict", policies);
+  lua_pop(L, 1); // []
+
+  lua_getfield(L, 1, "weights"); // [weights]
+  if (lua_istable(L, -1)) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+      lua_rawgeti(L, -1, i + 1); // [weights][weight]
+      weights[i] = luaL_checkint(L, -1);
+      lua_pop(L, 1); // [weights]
+    }
+    pw = weights;
+  }
+  lua_pop(L, 1); // []
+
+  lua_getfield(L, 1, "starve"); // [starve]
+  int starve = luaL_optint(L, -1, POOL_STARVE_USEC);
+  lua_pop(L, 1); // []
+
+  int rc = lc_threadpool_set_priority(pool, policy, pw, starve);
+  if (rc != SUCCESS) {
+    return luaL_error(L, "Unable to set scheduling: %s", errmsg(rc));
+  }
+  return 0;
+}
+
+/*
+ * session:set_timeslice(usec) preempts the session's tasks once they have run for usec
+ * without yielding, zero (the default) turns preemption off.
+ */
+static int luas_set_timeslice(lua_State *L) {
+  lua_Session *ls = get_session(L, 1);
+  int usec = luaL_checkint(L, 2);
+  if (session_set_timeslice(ls->sid, usec) != SUCCESS) {
+    return luaL_error(L, "Unable to set time slice");
+  }
+  return 0;
+}
+
+/*
+ * session:set_memory_limit(bytes) caps how much memory the session's state may hold, zero
+ * for no limit. Allocations past it fail with a memory error in the task that made them.
+ */
+static int luas_set_memory_limit(lua_State *L) {
+  lua_Session *ls = get_session(L, 1);
+  lua_Number limit = luaL_checknumber(L, 2);
+  if (limit < 0 || session_set_memory_limit(ls->sid, (size_t) limit) != SUCCESS) {
+    return luaL_error(L, "Unable to set memory limit");
+  }
+  return 0;
+}
+
+// session:memory() returns the bytes the session's state has live, its peak and its limit
+static int luas_memory(lua_State *L) {
+  lua_Session *ls = get_session(L, 1);
+  size_t live, peak, limit;
+  if (session_memory(ls->sid, &live, &peak, &limit) != SUCCESS) {
+    return luaL_error(L, "Invalid session");
+  }
+  lua_pushnumber(L, live);
+  lua_pushnumber(L, peak);
+  lua_pushnumber(L, limit);
+  return 3;
 }
 
 static int luas_destroy(lua_State *L) {
@@ -318,14 +1240,22 @@ static int luas_destroy(lua_State *L) {
 
 static int luas_tostring(lua_State *L) {
   lua_Session *ls = get_session(L, 1);
-  lua_pushfstring(L, CASTING_SESSION " <%f>", ls->sid);
+  lua_pushfstring(L, CASTING_SESSION " <%f>", (lua_Number) ls->sid);
   return 1;
 }
 
 static luaL_Reg functions[] = { { "new", luaS_newsession },
                                  { "close", luaS_close },
+                                 { "resume_all", luaS_resume_all },
                                  { "threads", luaT_threads },
                                  { "set_threads", luaT_set_threads },
+                                 { "set_affinity", luaT_set_affinity },
+                                 { "set_scheduling", luaT_set_scheduling },
+                                 { "stats", luaT_stats },
+                                 { "set_quantum", luaT_set_quantum },
+                                 { "set_states", luaT_set_states },
+                                 { "states", luaT_states },
+                                 { "set_gc", luaT_set_gc },
                                  { NULL, NULL } };
 
 static luaL_Reg session_meths[] = { { "__gc", luas_destroy },
@@ -333,6 +1263,10 @@ static luaL_Reg session_meths[] = { { "__gc", luas_destroy },
                                      { "create", luaS_createtask },
                                     { "wait", luas_wait },
                                      { "close", luaS_close },
+                                     { "set_priority", luas_set_priority },
+                                     { "set_timeslice", luas_set_timeslice },
+                                     { "set_memory_limit", luas_set_memory_limit },
+                                     { "memory", luas_memory },
                                      { NULL, NULL } };
 
 void init_session( ) {
@@ -341,10 +1275,13 @@ void init_session( ) {
   while (!atomic_int_cas(&init, 1, 1)) {
     pool = lc_threadpool_new(1, 2);
     task_key = lc_local_new(NULL);
-    lock = lc_spin_new();
-    sessions = map_new(cmp_session, dup_session, rel_session);
+    sessions = lc_handles_new(session_destroy);
+    states_lock = lc_spin_new();
+    idle_lock = lc_spin_new();
+    lc_threadpool_set_idle_hook(pool, session_sweep, NULL);
     INFO("Initialized session");
     init = 1;
+    state_schedule_refill();
   }
 }
 
@@ -5,36 +5,68 @@
 #include "casting.h"
 #include "message.h"
 #include "lc_thread.h"
+#include "lc_handle.h"
+#include "lc_timer.h"
 #include "lc_task.h"
 #include "queue.h"
 
 #define CASTING_SESSION "casting.session"
 #define CASTING_TASK  "casting.task"
 
+#define SESSION_QUANTUM_JOBS  16
+#define SESSION_QUANTUM_USEC  2000
+
+#define STATE_POOL_SIZE       4
+#define STATE_POOL_MAX        256
+#define STATE_POOL_GROWTH     4
+
+#define SESSION_GC_STEP       16
+#define SESSION_GC_SLICE      500
+#define SESSION_GC_IDLE       5000
+#define SESSION_GC_DELAY      10
+#define SESSION_GC_TRIM       1000
+
+#define TASK_HOOK_COUNT       1000
+
 typedef enum {
   ready=1,running,suspended,finished,error
 } status_t;
 
-typedef double session_id;
-typedef double task_id;
+typedef lc_handle_t session_id;
+typedef lc_handle_t task_id;
 
 typedef struct _session {
   session_id id;
-  int ref_count;
   lc_spin_t *lock;
   lua_State *state;
   status_t status;
   lc_sem_t *sem;
   queue_t *tasks;
+  int node;
+  int prio;
+  int scheduled;
+  int timeslice;
+  int failed;          // a task ended in an error, so the state isn't pooled again
+  uint64_t task_usec;  // moving average of how long its tasks run for
+  lc_job_t job;
+  // idle garbage collection
+  uint64_t idle_since;
+  int gc_pending;
+  int collected;
+  int idle;
+  struct _session *idle_next;
+  struct _session *idle_prev;
+  lc_job_t gc_job;
+  lc_timer_t gc_timer;
 } session_t;
 
 typedef struct _task {
   task_id id;
   session_id sid;
-  int ref_count;
   lua_State *L;
   lc_spin_t *lock;
   status_t status;
+  struct _sleeper *sleeper;  // the timer of a task in casting.sleep(), under the lock
 } task_t;
 
 typedef struct {
@@ -48,20 +80,36 @@ typedef struct {
 int lc_open_task(lua_State *L);
 
 session_id session_new( );
+int session_close(session_id sid);
 int session_queue_task(task_id tid,message_t *m);
-int session_run(session_id sid);
+int session_queue_tasks(task_id *tids, int count, message_t *m);
+int session_run(session_t *s);
+int session_set_priority(session_id sid, int prio);
+int session_set_quantum(int jobs, int usec);
+int session_set_timeslice(session_id sid, int usec);
+int session_load(session_id sid, int *pending, uint64_t *task_usec);
+int session_set_states(int size);
+int session_set_gc(int step_kb, int slice_usec, int idle_millis);
+int session_set_memory_limit(session_id sid, size_t limit);
+int session_memory(session_id sid, size_t *live, size_t *peak, size_t *limit);
+int session_states( );
 
 session_id lc_createsession(lua_State *L);
 task_id lc_createtask(lua_State *L, session_id sid);
+int lc_spawntask(lua_State *L, session_id sid);
 
 task_id task_new(session_id sid);
 task_t *task_ref(task_id tid);
 int task_free(task_id tid);
 
 task_id task_current( );
+task_id task_of(lua_State *L);
 void task_set_current(task_id tid);
-int task_run(task_id tid,lua_State *L,message_t *m);
+int task_run(task_id tid,lua_State *L,message_t *m,int slice_usec);
 int task_resume(task_id tid, message_t *m);
+int task_resume_all(task_id *tids, int count, message_t *m);
 int task_yield(task_id tid);
+int lc_task_yield(lua_State *L);
+int lc_task_sleep(lua_State *L);
 
 #endif // __LC_SESSION_H__
@@ -1,108 +1,152 @@
 #include <string.h>
+#include <lauxlib.h>
 #include "lc_session.h"
+#include "lc_timer.h"
+#include "lc_arena.h"
+
+// what each pool thread knows about the task it is running
+typedef struct {
+  task_id tid;
+  lua_State *L;        // the task's own thread, nested coroutines are never preempted
+  uint64_t deadline;   // when the task has to give up the thread, 0 for never
+  int yielded;         // gave up the thread, rather than waiting on something
+} task_local_t;
 
 static lc_local_t *task_key;
-static lc_spin_t *lock;
-static map_t *tasks;
-static lc_local_t *task_key;
+static lc_handles_t *tasks;
 
 static void task_key_deleter(void *d) {
   lc_free(d);
 }
 
-void task_set_current(task_id tid) {
-  task_id *ptid = lc_local_get(task_key);
-  if (!ptid) {
-    ptid = lc_alloc(sizeof(task_id));
-    *ptid = tid;
-    lc_local_set(task_key, ptid);
+static task_local_t *task_local( ) {
+  task_local_t *tl = lc_local_get(task_key);
+  if (!tl) {
+    tl = lc_alloc(sizeof(task_local_t));
+    if (!tl) return NULL;
+    memset(tl, 0, sizeof(task_local_t));
+    lc_local_set(task_key, tl);
   }
+  return tl;
+}
+
+void task_set_current(task_id tid) {
+  task_local_t *tl = task_local();
+  if (tl) tl->tid = tid;
 }
 
 task_id task_current( ) {
-  task_id *ptid = lc_local_get(task_key);
-  return (ptid) ? *ptid : 0;
+  task_local_t *tl = lc_local_get(task_key);
+  return (tl) ? tl->tid : 0;
 }
 
-static int cmp_task(const void *a, const void *b) {
-  int a_id = ((task_t *) a)->id;
-  int b_id = ((task_t *) b)->id;
-  return a_id == b_id ? 0 : a_id > b_id ? 1 : -1;
+// the task running on this thread, provided L is its own thread and so can be suspended
+task_id task_of(lua_State *L) {
+  task_local_t *tl = lc_local_get(task_key);
+  return (tl && tl->L == L) ? tl->tid : 0;
 }
 
-static int dup_task(const void *a, void **n) {
-  task_t *d = (task_t *) lc_alloc(sizeof(task_t));
-  if (d) {
-    memcpy(d, a, sizeof(task_t));
+/*
+ * A hook can only yield when there is nothing but Lua between it and lua_resume. C
+ * functions are easy to spot, but metamethods and the iterators of generic fors are Lua
+ * functions called from C, so any frame with a Lua caller that doesn't know it by name is
+ * taken to be one of those.
+ */
+static int task_can_yield(lua_State *L) {
+  lua_Debug ar, caller;
+  for (int level = 0; lua_getstack(L, level, &ar); level++) {
+    lua_getinfo(L, "Sn", &ar);
+    if (ar.what[0] == 'C' || ar.what[0] == 't') return 0;
+    if (!lua_getstack(L, level + 1, &caller)) break; // the task's own function
+    if (!ar.namewhat[0] || (ar.name && !strcmp(ar.name, "(for generator)"))) return 0;
   }
-  *n = d;
-  return 0;
+  return 1;
 }
 
-static void rel_task(void *d) {
-  lc_free(d);
+// the count hook, which yields a task that has run past its time slice
+static void task_hook(lua_State *L, lua_Debug *ar) {
+  task_local_t *tl = lc_local_get(task_key);
+  if (!tl || tl->L != L || !tl->deadline || lc_clock_usec() < tl->deadline) return;
+  if (!task_can_yield(L)) return;
+  tl->yielded = 1;
+  lua_yield(L, 0);
 }
 
-static task_t *tasks_find(task_id tid) {
-  task_t f = { tid };
-  lc_spin_lock(lock);
-  task_t *t = map_find(tasks, &f);
-  lc_spin_unlock(lock);
-  return t;
+// gives the running task a time slice, a slice of zero lets it run until it yields
+static void task_arm(task_t *t, int slice_usec) {
+  task_local_t *tl = task_local();
+  if (!tl) return;
+  tl->L = t->L;
+  tl->yielded = 0;
+  tl->deadline = slice_usec > 0 ? lc_clock_usec() + slice_usec : 0;
+
+  if (slice_usec > 0) {
+    lua_sethook(t->L, task_hook, LUA_MASKCOUNT, TASK_HOOK_COUNT);
+  } else if (lua_gethook(t->L) == task_hook) {
+    lua_sethook(t->L, NULL, 0, 0);
+  }
 }
 
-task_t *task_ref(task_id tid) {
-  task_t f = { tid };
-  lc_spin_lock(lock);
-  task_t *t = map_find(tasks, &f);
-  if (t) {
-    atomic_int_inc(&t->ref_count);
-  }
-  lc_spin_unlock(lock);
+// called by the handle table once the last reference to the task has gone
+static void task_destroy(void *d) {
+  task_t *t = (task_t *) d;
+  lc_spin_destroy(t->lock);
+  lc_free(t);
+}
 
-  return t;
+task_t *task_ref(task_id tid) {
+  return lc_handle_ref(tasks, tid);
 }
 
 int task_free(task_id tid) {
-  task_t f = { tid };
-
-  do {
-    lc_spin_lock(lock);
-    task_t *t = map_find(tasks, &f);
-    if (t) {
-      if (atomic_int_dec(&t->ref_count) > 0) break;
-      map_remove(tasks, t);
-      lc_free(t);
-      //printf("Freed task <%f>\n",tid);
-    }
-  } while (0);
-
-  lc_spin_unlock(lock);
-
-  return SUCCESS;
+  return lc_handle_release(tasks, tid);
 }
 
 task_id task_new(session_id sid) {
-  static task_id next = 0;
-
-  task_t t = { };
-  do {
-    t.sid = sid;
-    t.ref_count = 1;
-    t.L = NULL;
-    t.lock = lc_spin_new();
-    t.status = ready;
+  task_t *t = lc_alloc(sizeof(task_t));
+  if (!t) return HANDLE_NONE;
+
+  memset(t, 0, sizeof(task_t));
+  t->sid = sid;
+  t->L = NULL;
+  t->lock = lc_spin_new();
+  t->status = ready;
+
+  t->id = lc_handle_new(tasks, t);
+  if (t->id == HANDLE_NONE) task_destroy(t);
+  return t->id;
+}
 
-    lc_spin_lock(lock);
-    t.id = ++next;
-    map_insert(tasks, &t);
-    lc_spin_unlock(lock);
-  } while (0);
+static lc_arena_t *task_arena(lua_State *L) {
+  void *ud;
+  return lua_getallocf(L, &ud) == lc_arena_alloc ? (lc_arena_t *) ud : NULL;
+}
 
-  return t.id;
+/*
+ * Makes the task's thread if it hasn't got one yet and decodes the message onto it. This
+ * happens outside any protected call, where a memory error would take the whole process
+ * down, so the session's memory limit is lifted meanwhile. If that leaves the session over
+ * its limit, the task fails with a memory error instead of running.
+ */
+static int task_prepare(task_t *t, lua_State *L, message_t *m, int *count) {
+  lc_arena_t *arena = task_arena(L);
+  size_t limit = lc_arena_limit(arena);
+  if (limit) lc_arena_set_limit(arena, 0);
+
+  if (!t->L) t->L = lua_newthread(L);
+  *count = m ? lua_decodemessage(t->L, m) : 0;
+  if (m) msg_destroy(m);
+
+  if (limit) lc_arena_set_limit(arena, limit);
+  return limit && lc_arena_live(arena) > limit ? ERR_NOMEM : SUCCESS;
 }
 
-int task_run(task_id tid, lua_State *L, message_t *m) {
+/*
+ * Runs a task until it finishes or yields. A task that yields to let others run, either
+ * through casting.yield() or because it used up its time slice, is queued again. Returns
+ * ERR_BADSTATE if the task ended in an error, which may have left the state half changed.
+ */
+int task_run(task_id tid, lua_State *L, message_t *m, int slice_usec) {
   task_t *t = task_ref(tid);
   if (!t) return ERR_INVAL;
 
@@ -116,41 +160,56 @@ int task_run(task_id tid, lua_State *L, message_t *m) {
         t->status = finished;
         break;
       }
-      t->L = lua_newthread(L);
-      count = lua_decodemessage(t->L, m) - 1;
-      msg_destroy(m);
+      if (task_prepare(t, L, m, &count) != SUCCESS) {
+        rc = LUA_ERRMEM;
+        break;
+      }
       t->status = running;
-      STACK(t->L,"Resume from ready %f\n",t->id);
-      rc = lua_resume(t->L, count);
+      task_arm(t, slice_usec);
+      STACK(t->L,"Resume from ready %f\n",(lua_Number) t->id);
+      // the function to run is the first value
+      rc = lua_resume(t->L, count - 1);
       break;
     case suspended:
-      count = m ? lua_decodemessage(t->L, m) : 0;
-      if (m) msg_destroy(m);
+      if (task_prepare(t, L, m, &count) != SUCCESS) {
+        rc = LUA_ERRMEM;
+        break;
+      }
       t->status = running;
-      STACK(t->L,"Resume from suspended %f\n",t->id);
+      task_arm(t, slice_usec);
+      STACK(t->L,"Resume from suspended %f\n",(lua_Number) t->id);
       rc = lua_resume(t->L, count);
       break;
     default:
       break;
   }
 
-  if (rc == LUA_ERRRUN) {
-    INFO("Error code %d",rc);
-    t->status = error;
-    STACK(t->L,"Error running task");
-  } else if (rc == LUA_YIELD) {
-    STACK(t->L,"YIELDED (ref = %d)",t->ref_count);
+  if (rc == LUA_YIELD) {
+    STACK(t->L,"YIELDED");
     t->status = suspended; // TODO YIELD
   } else if (rc == 0) {
-    STACK(t->L,"QUITTED (ref = %d)",t->ref_count);
+    STACK(t->L,"QUITTED");
     t->status = finished;
+  } else {
+    // run time errors, memory errors (the session's limit) and errors in error handling
+    INFO("Error code %d",rc);
+    t->status = error;
+    STACK(t->L,"Error running task");
+  }
+
+  task_local_t *tl = lc_local_get(task_key);
+  int requeue = rc == LUA_YIELD && tl && tl->yielded;
+  if (tl) {
+    tl->L = NULL;
+    tl->deadline = 0;
+    tl->yielded = 0;
   }
 
   // TODO task->coro = get current coroutine
   task_set_current(0);
+  if (requeue) session_queue_task(tid, NULL);
   task_free(tid);
-  // TODO handle rc
-  return SUCCESS;
+  return rc == 0 || rc == LUA_YIELD ? SUCCESS : ERR_BADSTATE;
 }
 
 int task_yield(task_id tid) {
@@ -162,9 +221,108 @@ int task_yield(task_id tid) {
   return lua_yield(L,0);
 }
 
+/*
+ * casting.yield() lets the other tasks and sessions waiting for the pool run before the
+ * calling task carries on. Outside a task there is nothing to hand over to.
+ */
+int lc_task_yield(lua_State *L) {
+  task_local_t *tl = lc_local_get(task_key);
+  if (!tl || !tl->tid) return 0;
+  if (tl->L != L) {
+    return luaL_error(L, "casting.yield can't be called from within a coroutine");
+  }
+  tl->yielded = 1;
+  return lua_yield(L, 0);
+}
+
+/*
+ * A sleeping task can be resumed by something else before its timer is up, in which case
+ * the timer mustn't resume it again at whatever it is waiting for by then. Whoever resumes
+ * the task first marks the sleeper woken; the timer owns the sleeper and frees it.
+ */
+typedef struct _sleeper {
+  lc_timer_t timer;
+  task_id tid;
+  int woken;
+} sleeper_t;
+
+// must be called with the task lock held
+static void task_unsleep(task_t *t) {
+  if (t->sleeper) {
+    t->sleeper->woken = 1;
+    t->sleeper = NULL;
+  }
+}
+
+static void task_wake(void *data) {
+  sleeper_t *s = (sleeper_t *) data;
+  int woken = 1;
+  task_t *t = task_ref(s->tid);
+  if (t) {
+    lc_spin_lock(t->lock);
+    woken = s->woken;
+    if (t->sleeper == s) t->sleeper = NULL;
+    lc_spin_unlock(t->lock);
+    task_free(s->tid);
+  }
+  if (!woken) task_resume(s->tid, NULL);
+  lc_free(s);
+}
+
+/*
+ * casting.sleep(millis) suspends the calling task until a timer resumes it, leaving the
+ * thread to the other tasks. Outside a task the calling thread itself sleeps.
+ */
+int lc_task_sleep(lua_State *L) {
+  lua_Number millis = luaL_checknumber(L, 1);
+  luaL_argcheck(L, millis >= 0, 1, "negative sleep");
+
+  task_local_t *tl = lc_local_get(task_key);
+  if (!tl || !tl->tid) {
+    lc_thread_sleep((long) millis);
+    return 0;
+  }
+  if (tl->L != L) {
+    return luaL_error(L, "casting.sleep can't be called from within a coroutine");
+  }
+
+  sleeper_t *s = lc_alloc(sizeof(sleeper_t));
+  if (!s) {
+    return luaL_error(L, "Unable to sleep. Insufficient memory ?");
+  }
+  s->tid = tl->tid;
+  s->woken = 0;
+  lc_timer_init(&s->timer, task_wake, s);
+
+  task_t *t = task_ref(tl->tid);
+  if (!t) {
+    lc_free(s);
+    return luaL_error(L, "Invalid task");
+  }
+  lc_spin_lock(t->lock);
+  t->sleeper = s;
+  lc_spin_unlock(t->lock);
+
+  int rc = lc_timer_start(&s->timer, (long) millis);
+  if (rc != SUCCESS) {
+    lc_spin_lock(t->lock);
+    t->sleeper = NULL;
+    lc_spin_unlock(t->lock);
+    lc_free(s);
+  }
+  task_free(tl->tid);
+  if (rc != SUCCESS) {
+    return luaL_error(L, "Unable to start timer");
+  }
+  return lua_yield(L, 0);
+}
+
 int task_resume(task_id tid, message_t *m) {
   task_t *t = task_ref(tid);
   if (!t) return ERR_INVAL;
+  lc_spin_lock(t->lock);
+  task_unsleep(t);
+  lc_spin_unlock(t->lock);
   int status = t->status;
   task_free(tid);
   if (status == finished || status == error) return ERR_TASKSTATE;
@@ -172,13 +330,34 @@ int task_resume(task_id tid, message_t *m) {
   return session_queue_task(tid, m);
 }
 
+/*
+ * Resumes every runnable task in tids with a reference to the same message, skipping tasks
+ * that have finished. The caller keeps its own reference to m. Returns the number resumed.
+ */
+int task_resume_all(task_id *tids, int count, message_t *m) {
+  int n = 0;
+  for (int i = 0; i < count; i++) {
+    task_t *t = task_ref(tids[i]);
+    if (!t) continue;
+    lc_spin_lock(t->lock);
+    task_unsleep(t);
+    lc_spin_unlock(t->lock);
+    int status = t->status;
+    task_free(tids[i]);
+    if (status == finished || status == error) continue;
+    tids[n++] = tids[i];
+  }
+
+  return session_queue_tasks(tids, n, m);
+}
+
 task_id lc_createtask(lua_State *L, session_id sid) {
   task_id tid = task_new(sid);
-  if (tid > 0) {
+  if (tid != HANDLE_NONE) {
     lua_Task *lt = (lua_Task *) lua_newuserdata(L, sizeof(lua_Task)); // [task]
     if (!lt) {
       task_free(tid);
-      return FAIL;
+      return HANDLE_NONE;
     }
 
     lt->tid = tid;
@@ -197,6 +376,9 @@ static int luat_resume(lua_State *L) {
   lua_Task *lt = get_task(L, 1);
   int top = lua_gettop(L);
   message_t *m = lua_newmessage(L, top - 1);
+  if (!m) {
+    return luaL_error(L, "Unable to encode parameters");
+  }
   int rc = task_resume(lt->tid, m);
   if (rc != SUCCESS) {
     return luaL_error(L, "Unable to resume task %d", rc);
@@ -213,7 +395,7 @@ static int luat_destroy(lua_State *L) {
 
 static int luat_tostring(lua_State *L) {
   lua_Task *lt = get_task(L, 1);
-  lua_pushfstring(L, CASTING_TASK " <%f>", lt->tid);
+  lua_pushfstring(L, CASTING_TASK " <%f>", (lua_Number) lt->tid);
   return 1;
 }
 
@@ -227,8 +409,7 @@ static void init_task( ) {
 
   while (!atomic_int_cas(&init, 1, 1)) {
     task_key = lc_local_new(task_key_deleter);
-    lock = lc_spin_new();
-    tasks = map_new(cmp_task, dup_task, rel_task);
+    tasks = lc_handles_new(task_destroy);
     INFO("Initialized task");
     init = 1;
   }
@@ -1,9 +1,23 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <time.h>
 #include <sys/time.h>
 #include <pthread.h>
+#include <sched.h>
 #include <semaphore.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "lc_thread.h"
 #include "lc_error.h"
@@ -11,83 +25,167 @@
 #include "queue.h"
 #include "casting.h"
 
-void *atomic_ptr_get(volatile void *addr) {
-  __sync_synchronize();
-  void *p = *(void **) addr;
-  return p;
-}
-
-void atomic_ptr_set(volatile void *addr, void *p) {
-  __sync_synchronize();
-  *(void **) addr = p;
+uint64_t lc_clock_usec( ) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-int atomic_ptr_cas(volatile void *addr, void *o, void *n) {
-  return __sync_bool_compare_and_swap((volatile void **) addr, o, n);
+static inline struct timespec usec_timespec(uint64_t usec) {
+  struct timespec ts;
+  ts.tv_sec = usec / 1000000;
+  ts.tv_nsec = (usec % 1000000) * 1000;
+  return ts;
 }
 
-int atomic_int_get(volatile int *addr) {
-  __sync_synchronize();
-  int i = *addr;
-  return i;
+// blocks the calling thread, for callers that have nothing better to do with it
+int lc_thread_sleep(long millis) {
+  if (millis < 0) return ERR_INVAL;
+  struct timespec ts = usec_timespec((uint64_t) millis * 1000);
+  while (nanosleep(&ts, &ts) != 0) {
+    if (errno != EINTR) return FAIL;
+  }
+  return SUCCESS;
 }
 
-void atomic_int_set(volatile int *addr, int i) {
-  __sync_synchronize();
-  *addr = i;
-}
+typedef struct _thread_start {
+  threadpool_fn fn;
+  void *data;
+} thread_start_t;
 
-int atomic_int_cas(volatile int *addr, int o, int n) {
-  return __sync_bool_compare_and_swap(addr, o, n);
+static void *thread_main(void *data) {
+  thread_start_t start = *(thread_start_t *) data;
+  lc_free(data);
+  start.fn(start.data);
+  return NULL;
 }
 
-int atomic_int_tas(volatile int *addr, int n) {
-  return __sync_lock_test_and_set(addr, n);
+// starts a detached thread of its own for fn, for services that can't share the pool
+int lc_thread_start(threadpool_fn fn, void *data) {
+  if (!fn) return ERR_INVAL;
+  thread_start_t *start = lc_alloc(sizeof(thread_start_t));
+  if (!start) return ERR_NOMEM;
+  start->fn = fn;
+  start->data = data;
+
+  pthread_t tid;
+  if (pthread_create(&tid, NULL, thread_main, start) != 0) {
+    lc_free(start);
+    return ERR_THREADFAIL;
+  }
+  pthread_detach(tid);
+  return SUCCESS;
 }
 
-int atomic_int_add(volatile int *addr, int i) {
-  return __sync_add_and_fetch(addr, i);
+#ifdef __linux__
+static inline int futex_wait(volatile int *addr, int val, const struct timespec *ts) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, ts, NULL, 0);
 }
 
-int atomic_int_sub(volatile int *addr, int i) {
-  return __sync_sub_and_fetch(addr, i);
+static inline int futex_wake(volatile int *addr, int count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
 }
-
-int atomic_int_inc(volatile int *addr) {
-  return atomic_int_add(addr, 1);
+#else
+// no futex, so parking degrades to yielding the processor
+static inline int futex_wait(volatile int *addr, int val, const struct timespec *ts) {
+  if (*addr == val) sched_yield();
+  return 0;
 }
 
-int atomic_int_dec(volatile int *addr) {
-  return atomic_int_sub(addr, 1);
+static inline int futex_wake(volatile int *addr, int count) {
+  return 0;
 }
-
+#endif
+
+/*
+ * Spin locks spin for a bounded time, backing off exponentially between attempts, and then
+ * park the thread on a futex until the holder releases the lock.
+ *
+ * Adaptive locks use a single word: 0 is unlocked, 1 is locked and 2 is locked with
+ * (possibly) parked waiters. Ticket locks hand the lock over in arrival order, so a
+ * contended registry can't starve any one thread.
+ */
 struct _lc_spin {
+  lc_spin_type_t type;
   volatile int s;
+  volatile int next;
+  volatile int serving;
+  volatile int parked;
 };
 
-static inline int lc_spin_init(lc_spin_t *spin) {
+static inline void backoff(int *delay) {
+  for (int i = 0; i < *delay; i++) {
+    cpu_relax();
+  }
+  if (*delay < SPIN_BACKOFF_MAX) *delay <<= 1;
+}
+
+static inline int lc_spin_init(lc_spin_t *spin, lc_spin_type_t type) {
+  spin->type = type;
   spin->s = 0;
+  spin->next = 0;
+  spin->serving = 0;
+  spin->parked = 0;
   return SUCCESS;
 }
 
-lc_spin_t *lc_spin_new( ) {
+lc_spin_t *lc_spin_new_type(lc_spin_type_t type) {
   lc_spin_t *s = lc_alloc(sizeof(lc_spin_t));
   if (!s) return NULL;
-  lc_spin_init(s);
+  lc_spin_init(s, type);
   return s;
 }
 
-int lc_spin_lock(lc_spin_t *s) {
-  if (!s) return ERR_INVAL;
-  while (!atomic_int_cas(&s->s, 0, 1)) {
-    sched_yield();
+lc_spin_t *lc_spin_new( ) {
+  return lc_spin_new_type(LC_SPIN_DEFAULT);
+}
+
+static int adaptive_lock(lc_spin_t *s) {
+  int delay = 1;
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (atomic_int_get_relaxed(&s->s) == 0 && atomic_int_cas_acquire(&s->s, 0, 1)) {
+      return SUCCESS;
+    }
+    backoff(&delay);
+  }
+
+  // mark the lock as contended, and sleep until the holder hands it back
+  while (atomic_int_tas(&s->s, 2) != 0) {
+    futex_wait(&s->s, 2, NULL);
   }
   return SUCCESS;
 }
 
+static int ticket_lock(lc_spin_t *s) {
+  int ticket = atomic_int_add_relaxed(&s->next, 1) - 1;
+  int delay = 1;
+  for (int i = 0; i < SPIN_TRIES; i++) {
+    if (atomic_int_get_acquire(&s->serving) == ticket) return SUCCESS;
+    backoff(&delay);
+  }
+
+  atomic_int_inc(&s->parked);
+  int serving;
+  while ((serving = atomic_int_get(&s->serving)) != ticket) {
+    futex_wait(&s->serving, serving, NULL);
+  }
+  atomic_int_dec(&s->parked);
+  return SUCCESS;
+}
+
+int lc_spin_lock(lc_spin_t *s) {
+  if (!s) return ERR_INVAL;
+  return s->type == LC_SPIN_TICKET ? ticket_lock(s) : adaptive_lock(s);
+}
+
 int lc_spin_trylock(lc_spin_t *s) {
   if (!s) return ERR_INVAL;
-  if (atomic_int_cas(&s->s, 0, 1)) {
+  if (s->type == LC_SPIN_TICKET) {
+    int serving = atomic_int_get(&s->serving);
+    if (atomic_int_cas(&s->next, serving, serving + 1)) {
+      return SUCCESS;
+    }
+  } else if (atomic_int_cas_acquire(&s->s, 0, 1)) {
     return SUCCESS;
   }
   return FAIL;
@@ -95,12 +193,19 @@ int lc_spin_trylock(lc_spin_t *s) {
 
 int lc_spin_unlock(lc_spin_t *s) {
   if (!s) return ERR_INVAL;
-  atomic_int_tas(&s->s, 0);
+  if (s->type == LC_SPIN_TICKET) {
+    atomic_int_inc(&s->serving);
+    // every parked waiter checks whether it is next, so they all need waking
+    if (atomic_int_get(&s->parked) > 0) futex_wake(&s->serving, INT_MAX);
+  } else if (atomic_int_swap_release(&s->s, 0) == 2) {
+    futex_wake(&s->s, 1);
+  }
   return SUCCESS;
 }
 
 int lc_spin_destroy(lc_spin_t *s) {
-  // this is a no-op
+  if (!s) return ERR_INVAL;
+  lc_free(s);
   return SUCCESS;
 }
 
@@ -157,9 +262,15 @@ struct _lc_cond {
 lc_cond_t *lc_cond_new( ) {
   lc_cond_t *cond = lc_alloc(sizeof(lc_cond_t));
   if (cond) {
-    if (pthread_cond_init(&cond->cond, NULL) != 0) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#ifdef __linux__
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    if (pthread_cond_init(&cond->cond, &attr) != 0) {
       cond = lc_free(cond);
     }
+    pthread_condattr_destroy(&attr);
   }
   return cond;
 }
@@ -191,6 +302,9 @@ int lc_cond_wait(lc_cond_t *cond, lc_mutex_t *mtx) {
 int lc_cond_timedwait(lc_cond_t *cond, lc_mutex_t *mtx, long millis) {
   if (!cond || millis < 0) return ERR_INVAL;
 
+#ifdef __linux__
+  struct timespec ts = usec_timespec(lc_clock_usec() + millis * 1000);
+#else
   struct timespec ts;
   struct timeval tv;
   gettimeofday(&tv, NULL);
@@ -199,6 +313,7 @@ int lc_cond_timedwait(lc_cond_t *cond, lc_mutex_t *mtx, long millis) {
   ts.tv_sec = tv.tv_sec;
   ts.tv_sec += (tv.tv_usec / 1000000);
   ts.tv_nsec = (tv.tv_usec % 1000000) * 1000;
+#endif
 
   int rc = pthread_cond_timedwait(&cond->cond, &mtx->lock, &ts);
 
@@ -265,14 +380,15 @@ int lc_sem_destroy(lc_sem_t *s) {
 int lc_sem_timedwait(lc_sem_t *s, unsigned long millis) {
   if (!s) return ERR_INVAL;
 
+  // sem_timedwait() only takes a CLOCK_REALTIME deadline
   struct timespec ts;
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-
-  tv.tv_usec += (millis * 1000);
-  ts.tv_sec = tv.tv_sec;
-  ts.tv_sec += (tv.tv_usec / 1000000);
-  ts.tv_nsec = (tv.tv_usec % 1000000) * 1000;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += millis / 1000;
+  ts.tv_nsec += (millis % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
 
   if (sem_timedwait(&s->sem, &ts) != 0) {
     if (errno == ETIMEDOUT) {
@@ -283,6 +399,129 @@ int lc_sem_timedwait(lc_sem_t *s, unsigned long millis) {
   return SUCCESS;
 }
 
+/*
+ * An event count lets a thread wait for some condition without a lock. The waiter takes a
+ * key with lc_event_prepare(), re-checks its condition and then waits on the key; anyone
+ * making the condition true calls lc_event_notify() afterwards. Waiters spin briefly before
+ * sleeping on a futex, and notifying an event nobody is waiting on costs no system call.
+ */
+struct _lc_event {
+  volatile int seq;
+  volatile int waiters;
+};
+
+lc_event_t *lc_event_new( ) {
+  lc_event_t *ev = lc_alloc(sizeof(lc_event_t));
+  if (ev) {
+    ev->seq = 0;
+    ev->waiters = 0;
+  }
+  return ev;
+}
+
+static lc_local_t *event_key;
+static pthread_once_t event_once = PTHREAD_ONCE_INIT;
+
+static void event_deleter(void *d) {
+  lc_event_destroy((lc_event_t *) d);
+}
+
+static void event_key_init( ) {
+  event_key = lc_local_new(event_deleter);
+}
+
+/*
+ * The calling thread's own event, created the first time it asks. Any thread can get here
+ * first, so the key is made under pthread_once(). NULL when out of memory; the event
+ * functions take that as an event that never sleeps, so a waiter just spins.
+ */
+lc_event_t *lc_event_local( ) {
+  pthread_once(&event_once, event_key_init);
+  if (!event_key) return NULL;
+
+  lc_event_t *ev = lc_local_get(event_key);
+  if (!ev) {
+    ev = lc_event_new();
+    if (ev && lc_local_set(event_key, ev) != SUCCESS) {
+      lc_event_destroy(ev);
+      ev = NULL;
+    }
+  }
+  return ev;
+}
+
+int lc_event_prepare(lc_event_t *ev) {
+  if (!ev) return ERR_INVAL;
+  atomic_int_inc(&ev->waiters);
+  return atomic_int_get(&ev->seq);
+}
+
+int lc_event_cancel(lc_event_t *ev) {
+  if (!ev) return ERR_INVAL;
+  atomic_int_dec(&ev->waiters);
+  return SUCCESS;
+}
+
+int lc_event_wait(lc_event_t *ev, int key, long millis) {
+  if (!ev) return ERR_INVAL;
+
+  int rc = SUCCESS;
+  for (int i = 0; i < EVENT_SPINS; i++) {
+    if (atomic_int_get_acquire(&ev->seq) != key) goto done;
+    cpu_relax();
+  }
+
+  uint64_t deadline = millis < 0 ? 0 : lc_clock_usec() + millis * 1000;
+  while (atomic_int_get(&ev->seq) == key) {
+    if (millis < 0) {
+      futex_wait(&ev->seq, key, NULL);
+    } else {
+      uint64_t now = lc_clock_usec();
+      if (now >= deadline) {
+        rc = ERR_TIMEDOUT;
+        break;
+      }
+      struct timespec ts = usec_timespec(deadline - now);
+      futex_wait(&ev->seq, key, &ts);
+    }
+  }
+
+done:
+  atomic_int_dec(&ev->waiters);
+  return rc;
+}
+
+int lc_event_waiters(lc_event_t *ev) {
+  if (!ev) return ERR_INVAL;
+  return atomic_int_get(&ev->waiters);
+}
+
+static inline int event_signal(lc_event_t *ev, int count) {
+  if (!ev) return ERR_INVAL;
+  if (atomic_int_get(&ev->waiters) == 0) return SUCCESS;
+  atomic_int_inc(&ev->seq);
+  futex_wake(&ev->seq, count);
+  return SUCCESS;
+}
+
+int lc_event_notify(lc_event_t *ev) {
+  return event_signal(ev, 1);
+}
+
+int lc_event_notify_n(lc_event_t *ev, int count) {
+  return count > 0 ? event_signal(ev, count) : SUCCESS;
+}
+
+int lc_event_notify_all(lc_event_t *ev) {
+  return event_signal(ev, INT_MAX);
+}
+
+int lc_event_destroy(lc_event_t *ev) {
+  if (!ev) return ERR_INVAL;
+  lc_free(ev);
+  return SUCCESS;
+}
+
 struct _local {
   pthread_key_t key;
 };
@@ -320,99 +559,1005 @@ int lc_local_destroy(lc_local_t *local) {
   return SUCCESS;
 }
 
+typedef struct _job_list {
+  lc_job_t *head;
+  lc_job_t *tail;
+  int size;
+} job_list_t;
+
+static inline void jobs_init(job_list_t *l) {
+  l->head = l->tail = NULL;
+  l->size = 0;
+}
+
+static inline void jobs_push(job_list_t *l, lc_job_t *job) {
+  job->next = NULL;
+  if (l->tail) {
+    l->tail->next = job;
+  } else {
+    l->head = job;
+  }
+  l->tail = job;
+  l->size++;
+}
+
+static inline lc_job_t *jobs_pop(job_list_t *l) {
+  lc_job_t *job = l->head;
+  if (job) {
+    l->head = job->next;
+    if (!l->head) l->tail = NULL;
+    l->size--;
+  }
+  return job;
+}
+
+static inline int jobs_size(volatile job_list_t *l) {
+  return l->size;
+}
+
+/*
+ * A job queue keeps one FIFO per priority class. Under strict scheduling the highest class
+ * with work always goes first; under weighted scheduling each class gets up to its weight
+ * in jobs per round. Either way, a lower class whose oldest job has waited longer than the
+ * pool's starvation limit is served next, though never twice in a row, so a backlog of
+ * starved jobs can only take half the queue's turns.
+ */
+typedef struct _job_queue {
+  job_list_t cls[POOL_CLASSES];
+  int credit[POOL_CLASSES];
+  int aged;
+  int size;
+} job_queue_t;
+
+static inline void jobq_init(job_queue_t *q) {
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    jobs_init(&q->cls[i]);
+    q->credit[i] = 0;
+  }
+  q->aged = 0;
+  q->size = 0;
+}
+
+static inline int job_class(const lc_job_t *job) {
+  return (job->prio < 0 || job->prio >= POOL_CLASSES) ? LC_PRIO_NORMAL : job->prio;
+}
+
+static inline void jobq_push(job_queue_t *q, lc_job_t *job) {
+  jobs_push(&q->cls[job_class(job)], job);
+  q->size++;
+}
+
+// moves a chain of jobs onto the queue, sorting them into their classes
+static inline void jobq_splice(job_queue_t *q, job_list_t *chain) {
+  lc_job_t *job;
+  while ((job = jobs_pop(chain))) {
+    jobq_push(q, job);
+  }
+}
+
+static inline int jobq_size(volatile job_queue_t *q) {
+  return q->size;
+}
+
+static inline uint64_t jobq_oldest(job_queue_t *q) {
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    lc_job_t *head = q->cls[i].head;
+    if (head && head->queued < oldest) oldest = head->queued;
+  }
+  return oldest;
+}
+
+/*
+ * Each pool thread owns a worker slot with its own job queue. Jobs submitted from a pool
+ * thread go onto that thread's queue, jobs submitted from elsewhere go onto the pool's
+ * shared queue. An idle worker takes from its own queue first, then the shared queue, and
+ * finally steals from the other workers.
+ *
+ * Jobs created by lc_threadpool_run() come from a per-worker cache of spare jobs, which
+ * spills over into the pool's shared cache when it grows past JOB_CACHE_MAX.
+ */
+typedef struct _lc_worker {
+  lc_spin_t *lock;
+  lc_event_t *wake;
+  job_queue_t jobs;
+  lc_job_t *spare;
+  int nspare;
+  lc_threadpool_t *pool;
+  unsigned int victim;
+  int slot;
+  int node;
+  volatile int delay;
+  volatile int active;
+  // only ever written by the owning thread, so reading them needs no lock
+  volatile uint64_t executed;
+  volatile uint64_t busy_usec;
+  volatile uint64_t affinity_hits;
+  volatile uint64_t affinity_misses;
+  volatile uint64_t wait_hist[POOL_HIST_BUCKETS];
+  char pad[CACHE_LINE];
+} lc_worker_t;
+
+/*
+ * When the pool is NUMA aware, workers are spread across the nodes and pinned to their
+ * node's CPUs. Jobs submitted for a node wait on that node's queue, which its own workers
+ * check before the shared queue; workers elsewhere only take them when stealing.
+ */
+typedef struct _lc_node {
+  lc_spin_t *lock;
+  job_queue_t jobs;
+#ifdef __linux__
+  cpu_set_t cpus;
+#endif
+  char pad[CACHE_LINE];
+} lc_node_t;
+
+/*
+ * The pool sizes itself on queueing delay. A thread is added (at most one at a time, and no
+ * more often than once per target delay) when jobs have waited longer than target_delay
+ * and no worker is idle. A worker retires once it has been idle for idle_millis, provided
+ * the pool is above its minimum, its own delay has fallen below half the target and the
+ * pool hasn't grown in that time.
+ */
+/*
+ * Jobs queue per priority class, see job_queue_t. The policy, the class weights and the
+ * starvation limit apply to every queue in the pool.
+ */
 struct _lc_threadpool {
   lc_spin_t *lock;
-  lc_sem_t *sem;
+  lc_local_t *worker_key;
   int min_threads;
   int max_threads;
-  int threads;
-  queue_t jobs;
+  int target_delay;
+  int idle_millis;
+  threadpool_fn idle_hook;
+  void *idle_data;
+  volatile int threads;
+  volatile int idle;
+  volatile int spawning;
+  volatile uint64_t last_grow;
+  volatile int created;
+  volatile int retired;
+  int policy;
+  int weights[POOL_CLASSES];
+  int starve_usec;
+  job_queue_t jobs;
+  lc_job_t *spare;
+  int *cpus;
+  int ncpus;
+  int nnodes;
+  short cpu_node[POOL_MAX_CPUS];
+  lc_node_t nodes[POOL_MAX_NODES];
+  lc_worker_t workers[POOL_MAX_THREADS];
 };
 
-typedef struct _job {
-  void (*fn)(void *data);
-  void *data;
-} job_t;
+static inline int clamp_threads(int n) {
+  return n < 0 ? 0 : n > POOL_MAX_THREADS ? POOL_MAX_THREADS : n;
+}
 
 lc_threadpool_t *lc_threadpool_new(int min, int max) {
   lc_threadpool_t *pool = lc_alloc(sizeof(lc_threadpool_t));
   if (pool) {
     pool->lock = lc_spin_new();
-    pool->sem = lc_sem_new(0);
-    pool->min_threads = min;
-    pool->max_threads = max;
+    pool->worker_key = lc_local_new(NULL);
+    pool->min_threads = clamp_threads(min);
+    pool->max_threads = clamp_threads(max);
+    pool->target_delay = POOL_TARGET_DELAY;
+    pool->idle_millis = THREAD_WAIT_MILLIS;
+    pool->idle_hook = NULL;
+    pool->idle_data = NULL;
     pool->threads = 0;
-    queue_init(&pool->jobs, NULL, NULL);
+    pool->idle = 0;
+    pool->spawning = 0;
+    pool->last_grow = 0;
+    pool->created = 0;
+    pool->retired = 0;
+    pool->spare = NULL;
+    pool->cpus = NULL;
+    pool->ncpus = 0;
+    pool->nnodes = 0;
+    pool->policy = LC_SCHED_STRICT;
+    pool->starve_usec = POOL_STARVE_USEC;
+    for (int i = 0; i < POOL_CLASSES; i++) {
+      pool->weights[i] = 1 << (2 * (POOL_CLASSES - 1 - i));
+    }
+    jobq_init(&pool->jobs);
+    for (int i = 0; i < POOL_MAX_NODES; i++) {
+      pool->nodes[i].lock = lc_spin_new();
+      jobq_init(&pool->nodes[i].jobs);
+    }
+    for (int i = 0; i < POOL_MAX_THREADS; i++) {
+      lc_worker_t *w = &pool->workers[i];
+      w->lock = lc_spin_new();
+      w->wake = lc_event_new();
+      w->pool = pool;
+      w->spare = NULL;
+      w->nspare = 0;
+      w->victim = i + 1;
+      w->slot = i;
+      w->node = -1;
+      w->delay = 0;
+      w->active = 0;
+      w->executed = 0;
+      w->busy_usec = 0;
+      w->affinity_hits = 0;
+      w->affinity_misses = 0;
+      memset((void *) w->wait_hist, 0, sizeof(w->wait_hist));
+      jobq_init(&w->jobs);
+    }
   }
   return pool;
 }
 
-static job_t *next_job(lc_threadpool_t *tp) {
-  job_t *job = NULL;
-  while (lc_sem_timedwait(tp->sem, 2500) != SUCCESS) {
+static lc_job_t *jobq_pop(lc_threadpool_t *tp, job_queue_t *q) {
+  if (q->size == 0) return NULL;
+
+  int c = -1;
+  int top = 0;
+  while (q->cls[top].size == 0) top++;
+  if (!q->aged && q->size > q->cls[top].size && tp->starve_usec > 0) {
+    // something is waiting behind the top class, make sure it hasn't waited too long
+    uint64_t now = lc_clock_usec();
+    for (int i = POOL_CLASSES - 1; i > top && c < 0; i--) {
+      lc_job_t *head = q->cls[i].head;
+      if (head && now - head->queued > (uint64_t) tp->starve_usec) c = i;
+    }
+  }
+  q->aged = c >= 0;
+
+  if (c < 0 && tp->policy == LC_SCHED_WEIGHTED) {
+    for (int round = 0; round < 2 && c < 0; round++) {
+      for (int i = 0; i < POOL_CLASSES && c < 0; i++) {
+        if (q->cls[i].size > 0 && q->credit[i] > 0) c = i;
+      }
+      if (c < 0) {
+        for (int i = 0; i < POOL_CLASSES; i++) {
+          q->credit[i] = tp->weights[i];
+        }
+      }
+    }
+  }
+
+  if (c < 0) c = top;
+
+  if (q->credit[c] > 0) q->credit[c]--;
+  q->size--;
+  return jobs_pop(&q->cls[c]);
+}
+
+static lc_job_t *job_alloc(lc_threadpool_t *tp, lc_worker_t *w) {
+  lc_job_t *job = NULL;
+
+  if (w && w->spare) {
+    job = w->spare;
+    w->spare = job->next;
+    w->nspare--;
+  } else if (tp->spare) {
     lc_spin_lock(tp->lock);
-    if (tp->threads > tp->min_threads) {
-      lc_spin_unlock(tp->lock);
-      return job;
+    if ((job = tp->spare)) {
+      tp->spare = job->next;
     }
     lc_spin_unlock(tp->lock);
   }
 
-  do {
+  if (!job) {
+    job = lc_alloc(sizeof(lc_job_t));
+  }
+  return job;
+}
+
+static void job_release(lc_threadpool_t *tp, lc_worker_t *w, lc_job_t *job) {
+  job->next = w->spare;
+  w->spare = job;
+
+  if (++w->nspare > JOB_CACHE_MAX) {
+    // hand half the cache back so submitters outside the pool can reuse them
+    lc_job_t *head = w->spare;
+    lc_job_t *tail = head;
+    for (int i = 1; i < JOB_CACHE_MAX / 2; i++) {
+      tail = tail->next;
+    }
+    w->spare = tail->next;
+    w->nspare -= JOB_CACHE_MAX / 2;
+
     lc_spin_lock(tp->lock);
-    job = queue_pop(&tp->jobs);
+    tail->next = tp->spare;
+    tp->spare = head;
     lc_spin_unlock(tp->lock);
-  } while (0);
+  }
+}
+
+#ifdef __linux__
+/*
+ * Pins the calling worker: with a CPU list each worker gets one CPU from it in turn, and
+ * when NUMA aware the worker is confined to its node (and to the listed CPUs on that node).
+ */
+static void worker_place(lc_threadpool_t *tp, lc_worker_t *w, int slot) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+
+  lc_spin_lock(tp->lock);
+  int nnodes = tp->nnodes;
+  w->node = nnodes ? slot % nnodes : -1;
+
+  if (nnodes) {
+    lc_node_t *node = &tp->nodes[w->node];
+    int candidates = 0;
+    for (int i = 0; i < tp->ncpus; i++) {
+      if (CPU_ISSET(tp->cpus[i], &node->cpus)) candidates++;
+    }
+    if (candidates) {
+      int pick = (slot / nnodes) % candidates;
+      for (int i = 0; i < tp->ncpus; i++) {
+        if (CPU_ISSET(tp->cpus[i], &node->cpus) && pick-- == 0) {
+          CPU_SET(tp->cpus[i], &set);
+          break;
+        }
+      }
+    } else {
+      memcpy(&set, &node->cpus, sizeof(set));
+    }
+  } else if (tp->ncpus) {
+    CPU_SET(tp->cpus[slot % tp->ncpus], &set);
+  }
+  lc_spin_unlock(tp->lock);
+
+  if (CPU_COUNT(&set) > 0) {
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  }
+}
+#else
+static void worker_place(lc_threadpool_t *tp, lc_worker_t *w, int slot) {
+  w->node = -1;
+}
+#endif
+
+static lc_worker_t *worker_attach(lc_threadpool_t *tp) {
+  for (int i = 0; i < POOL_MAX_THREADS; i++) {
+    lc_worker_t *w = &tp->workers[i];
+    if (atomic_int_cas(&w->active, 0, 1)) {
+      lc_local_set(tp->worker_key, w);
+      w->delay = 0;
+      worker_place(tp, w, i);
+      return w;
+    }
+  }
+  return NULL;
+}
 
+static void pool_wake(lc_threadpool_t *tp, int count, int delay);
+
+static void worker_detach(lc_worker_t *w) {
+  lc_threadpool_t *tp = w->pool;
+  lc_job_t *job;
+
+  // hand anything left behind over to the shared queue and cache, waking someone to run it
+  lc_spin_lock(w->lock);
+  lc_spin_lock(tp->lock);
+  int left = w->jobs.size;
+  for (int i = 0; i < POOL_CLASSES; i++) {
+    jobq_splice(&tp->jobs, &w->jobs.cls[i]);
+  }
+  w->jobs.size = 0;
+  while ((job = w->spare)) {
+    w->spare = job->next;
+    job->next = tp->spare;
+    tp->spare = job;
+  }
+  w->nspare = 0;
+  lc_spin_unlock(tp->lock);
+  lc_spin_unlock(w->lock);
+
+  lc_local_set(tp->worker_key, NULL);
+  atomic_int_set(&w->active, 0);
+  if (left) pool_wake(tp, left, 0);
+}
+
+static inline lc_job_t *node_pop(lc_threadpool_t *tp, lc_node_t *node) {
+  lc_job_t *job = NULL;
+  if (jobq_size(&node->jobs) > 0) {
+    lc_spin_lock(node->lock);
+    job = jobq_pop(tp, &node->jobs);
+    lc_spin_unlock(node->lock);
+  }
   return job;
 }
 
+// steals from workers on our own node first, and only then from other nodes
+static lc_job_t *steal_job(lc_threadpool_t *tp, lc_worker_t *self) {
+  unsigned int start = self->victim++;
+  int passes = self->node < 0 ? 1 : 2;
+
+  for (int pass = 0; pass < passes; pass++) {
+    for (int i = 0; i < POOL_MAX_THREADS; i++) {
+      lc_worker_t *w = &tp->workers[(start + i) % POOL_MAX_THREADS];
+      if (w == self || jobq_size(&w->jobs) == 0) continue;
+      if (passes == 2 && (pass == 0) != (w->node == self->node)) continue;
+      if (lc_spin_trylock(w->lock) == SUCCESS) {
+        lc_job_t *job = jobq_pop(tp, &w->jobs);
+        lc_spin_unlock(w->lock);
+        if (job) return job;
+      }
+    }
+  }
+
+  // every node, not just the current ones, as jobs may still be queued for nodes that
+  // lc_threadpool_set_affinity() has since dropped
+  for (int i = 0; i < POOL_MAX_NODES; i++) {
+    lc_job_t *job = node_pop(tp, &tp->nodes[(start + i) % POOL_MAX_NODES]);
+    if (job) return job;
+  }
+  return NULL;
+}
+
+static lc_job_t *find_job(lc_threadpool_t *tp, lc_worker_t *w) {
+  lc_job_t *job = NULL;
+
+  if (jobq_size(&w->jobs) > 0) {
+    lc_spin_lock(w->lock);
+    job = jobq_pop(tp, &w->jobs);
+    lc_spin_unlock(w->lock);
+    if (job) return job;
+  }
+
+  if (w->node >= 0 && (job = node_pop(tp, &tp->nodes[w->node]))) {
+    return job;
+  }
+
+  if (jobq_size(&tp->jobs) > 0) {
+    lc_spin_lock(tp->lock);
+    job = jobq_pop(tp, &tp->jobs);
+    lc_spin_unlock(tp->lock);
+    if (job) return job;
+  }
+
+  return steal_job(tp, w);
+}
+
+static void *pool_thread(void *data);
+
+static int pool_wants_thread(lc_threadpool_t *tp, int delay) {
+  int threads = tp->threads;
+  if (threads == 0 || threads < tp->min_threads) return 1;
+  if (threads >= tp->max_threads || delay <= tp->target_delay) return 0;
+  if (tp->idle > 0) return 0;
+  return lc_clock_usec() - tp->last_grow >= tp->target_delay;
+}
+
+/*
+ * Starts one more pool thread, outside of any queue lock. Only one thread is ever being
+ * started at a time, so a burst of submissions can't turn into a burst of threads.
+ */
+static void pool_grow(lc_threadpool_t *tp, int delay) {
+  if (!atomic_int_cas(&tp->spawning, 0, 1)) return;
+
+  if (pool_wants_thread(tp, delay)) {
+    pthread_t tid;
+    atomic_int_inc(&tp->threads);
+    int rc = pthread_create(&tid,NULL,pool_thread,tp);
+    INFO("Started thread (%d:%d:%d) rc = %d",tp->threads,tp->min_threads,tp->max_threads,rc);
+    if (rc == 0) {
+      pthread_detach(tid);
+      atomic_int_add_relaxed(&tp->created, 1);
+      tp->last_grow = lc_clock_usec();
+    } else {
+      atomic_int_dec(&tp->threads);
+    }
+  }
+
+  atomic_int_set(&tp->spawning, 0);
+}
+
+static int pool_shrink(lc_threadpool_t *tp, lc_worker_t *w) {
+  w->delay >>= 1;
+  if (w->delay > tp->target_delay / 2) return 0;
+  if (lc_clock_usec() - tp->last_grow < tp->idle_millis * 1000ULL) return 0;
+
+  int threads;
+  while ((threads = tp->threads) > tp->min_threads) {
+    if (atomic_int_cas(&tp->threads, threads, threads - 1)) return 1;
+  }
+  return 0;
+}
+
+static lc_job_t *next_job(lc_threadpool_t *tp, lc_worker_t *w) {
+  lc_job_t *job;
+
+  for (;;) {
+    if ((job = find_job(tp, w))) return job;
+
+    // advertise that we're idle before the final look, so a submitter either sees us
+    // waiting or we see its job
+    atomic_int_inc(&tp->idle);
+    int key = lc_event_prepare(w->wake);
+    if ((job = find_job(tp, w))) {
+      lc_event_cancel(w->wake);
+      atomic_int_dec(&tp->idle);
+      return job;
+    }
+    int rc = lc_event_wait(w->wake, key, tp->idle_millis);
+    atomic_int_dec(&tp->idle);
+
+    threadpool_fn hook = tp->idle_hook;
+    if (rc == ERR_TIMEDOUT && hook) hook(tp->idle_data);
+    if (rc == ERR_TIMEDOUT && jobq_size(&w->jobs) == 0 && pool_shrink(tp, w)) return NULL;
+  }
+  return NULL;
+}
+
+// log2 buckets of queueing delay: bucket b holds delays below 2^b usec
+static inline int wait_bucket(int usec) {
+  int b = 0;
+  while (usec > 0 && b < POOL_HIST_BUCKETS - 1) {
+    usec >>= 1;
+    b++;
+  }
+  return b;
+}
+
 static void *pool_thread(void *data) {
   lc_threadpool_t *tp = (lc_threadpool_t *) data;
+  lc_worker_t *w = worker_attach(tp);
 
-  job_t *job;
-  while ((job = next_job(tp))) {
-    job->fn(job->data);
-    lc_free(job);
+  if (!w) {
+    atomic_int_dec(&tp->threads);
+    return NULL;
   }
 
-  atomic_int_dec(&tp->threads);
+  lc_job_t *job;
+  while ((job = next_job(tp, w))) {
+    // the job may be resubmitted (or freed) by its own function, so don't touch it after
+    threadpool_fn fn = job->fn;
+    void *data = job->data;
+    uint64_t start = lc_clock_usec();
+    int delay = start - job->queued;
+    if (job->worker) {
+      if (job->worker == w->slot + 1) {
+        w->affinity_hits++;
+      } else {
+        w->affinity_misses++;
+      }
+    }
+    job->worker = w->slot + 1;
+    if (job->pooled) job_release(tp, w, job);
+
+    w->delay += (delay - w->delay) / 8;
+    w->wait_hist[wait_bucket(delay)]++;
+    if (w->delay > tp->target_delay && (jobq_size(&w->jobs) || jobq_size(&tp->jobs))) {
+      pool_grow(tp, w->delay);
+    }
+    fn(data);
+
+    w->busy_usec += lc_clock_usec() - start;
+    w->executed++;
+  }
+
+  atomic_int_add_relaxed(&tp->retired, 1);
+  worker_detach(w);
   return NULL;
 }
 
+/*
+ * Where a job submitted by this thread goes. A job that has run before prefers the worker
+ * that last ran it, as long as that worker is idle or has nothing else queued; if it turns
+ * out to be busy when the job comes up, an idle worker steals it. Otherwise a pool thread
+ * resubmitting work keeps it local (unless it belongs on another node), and everyone else
+ * uses the node's queue or the shared queue. Returns the node, a worker's POOL_WORKER()
+ * target, POOL_LOCAL or POOL_SHARED.
+ */
+static inline int pool_target(lc_threadpool_t *tp, lc_worker_t *w, lc_job_t *job) {
+  int node = job->node;
+  if (node >= tp->nnodes) node = -1;
+
+  if (job->worker > 0 && job->worker <= POOL_MAX_THREADS) {
+    lc_worker_t *last = &tp->workers[job->worker - 1];
+    if (last != w && last->active && (node < 0 || last->node == node)
+        && (lc_event_waiters(last->wake) > 0 || jobq_size(&last->jobs) == 0)) {
+      return POOL_WORKER(last->slot);
+    }
+  }
+
+  if (w && (node < 0 || w->node == node)) return POOL_LOCAL;
+  return node >= 0 ? node : POOL_SHARED;
+}
+
+// appends a chain of jobs to the target queue, returning when the oldest job there queued
+static uint64_t pool_append(lc_threadpool_t *tp, lc_worker_t *w, int target, job_list_t *chain) {
+  lc_spin_t *lock;
+  job_queue_t *jobs;
+
+  if (target >= POOL_WORKER(0)) {
+    w = &tp->workers[target - POOL_WORKER(0)];
+    target = POOL_LOCAL;
+  }
+
+  if (target == POOL_LOCAL) {
+    lock = w->lock;
+    jobs = &w->jobs;
+  } else if (target == POOL_SHARED) {
+    lock = tp->lock;
+    jobs = &tp->jobs;
+  } else {
+    lock = tp->nodes[target].lock;
+    jobs = &tp->nodes[target].jobs;
+  }
+
+  lc_spin_lock(lock);
+  jobq_splice(jobs, chain);
+  uint64_t oldest = jobq_oldest(jobs);
+  lc_spin_unlock(lock);
+  return oldest;
+}
+
+/*
+ * Wakes the worker a job was queued for if it is idle, returning 0 if it wasn't and
+ * someone else has to be woken instead.
+ */
+static inline int pool_wake_worker(lc_threadpool_t *tp, int target) {
+  if (target < POOL_WORKER(0)) return 0;
+  lc_worker_t *w = &tp->workers[target - POOL_WORKER(0)];
+  if (lc_event_waiters(w->wake) == 0) return 0;
+  lc_event_notify(w->wake);
+  return 1;
+}
+
+// wakes up to count idle workers, and considers growing if there weren't enough of them
+static void pool_wake(lc_threadpool_t *tp, int count, int delay) {
+  int idle = tp->idle;
+  int woken = 0;
+  for (int i = 0; i < POOL_MAX_THREADS && woken < count && woken < idle; i++) {
+    lc_worker_t *w = &tp->workers[i];
+    if (lc_event_waiters(w->wake) > 0) {
+      lc_event_notify(w->wake);
+      woken++;
+    }
+  }
+  if (woken < count && pool_wants_thread(tp, delay)) {
+    pool_grow(tp, delay);
+  }
+}
+
+static int pool_push(lc_threadpool_t *tp, lc_worker_t *w, lc_job_t *job) {
+  uint64_t now = lc_clock_usec();
+  job_list_t chain;
+
+  job->queued = now;
+  jobs_init(&chain);
+  jobs_push(&chain, job);
+  int target = pool_target(tp, w, job);
+  uint64_t oldest = pool_append(tp, w, target, &chain);
+
+  if (!pool_wake_worker(tp, target)) {
+    pool_wake(tp, 1, now - oldest);
+  }
+  return SUCCESS;
+}
+
+int lc_threadpool_submit(lc_threadpool_t *tp, lc_job_t *job) {
+  return lc_threadpool_submit_node(tp, job, -1);
+}
+
+int lc_threadpool_submit_node(lc_threadpool_t *tp, lc_job_t *job, int node) {
+  if (!tp || !job || !job->fn) return ERR_INVAL;
+
+  job->pooled = 0;
+  job->node = node;
+  return pool_push(tp, lc_local_get(tp->worker_key), job);
+}
+
+/*
+ * Queues a set of jobs, each with the node it was given by its submitter, taking each
+ * target queue's lock once and waking as many idle workers as there are jobs in one go.
+ */
+int lc_threadpool_submit_batch(lc_threadpool_t *tp, lc_job_t **jobs, int count) {
+  if (!tp || !jobs || count < 0) return ERR_INVAL;
+  if (count == 0) return SUCCESS;
+
+  lc_worker_t *w = lc_local_get(tp->worker_key);
+  uint64_t now = lc_clock_usec();
+  uint64_t oldest = now;
+  job_list_t chains[POOL_WORKER(POOL_MAX_THREADS) + 2];
+
+  for (int i = 0; i < POOL_WORKER(POOL_MAX_THREADS) + 2; i++) {
+    jobs_init(&chains[i]);
+  }
+  for (int i = 0; i < count; i++) {
+    lc_job_t *job = jobs[i];
+    if (!job || !job->fn) return ERR_INVAL;
+  }
+  for (int i = 0; i < count; i++) {
+    lc_job_t *job = jobs[i];
+    job->queued = now;
+    jobs_push(&chains[pool_target(tp, w, job) + 2], job);
+  }
+  int woken = 0;
+  for (int i = 0; i < POOL_WORKER(POOL_MAX_THREADS) + 2; i++) {
+    if (chains[i].size == 0) continue;
+    int n = chains[i].size;
+    uint64_t t = pool_append(tp, w, i - 2, &chains[i]);
+    if (t < oldest) oldest = t;
+    if (pool_wake_worker(tp, i - 2)) woken += n;
+  }
+
+  pool_wake(tp, count - woken, now - oldest);
+  return SUCCESS;
+}
+
 int lc_threadpool_run(lc_threadpool_t *tp, threadpool_fn fn,void *data) {
-  int jobs;
-  job_t *job = lc_alloc(sizeof(job_t));
+  if (!tp || !fn) return ERR_INVAL;
+
+  lc_worker_t *w = lc_local_get(tp->worker_key);
+  lc_job_t *job = job_alloc(tp, w);
+  if (!job) return ERR_NOMEM;
+
   job->fn = fn;
   job->data = data;
+  job->pooled = 1;
+  job->node = -1;
+  job->prio = LC_PRIO_NORMAL;
+  job->worker = 0;
+  return pool_push(tp, w, job);
+}
+
+int lc_threadpool_run_batch(lc_threadpool_t *tp, threadpool_fn fn, void **data, int count) {
+  if (!tp || !fn || !data || count < 0) return ERR_INVAL;
+
+  lc_worker_t *w = lc_local_get(tp->worker_key);
+  lc_job_t *small[BATCH_SIZE];
+  lc_job_t **jobs = count > BATCH_SIZE ? lc_alloc(sizeof(lc_job_t *) * count) : small;
+  if (!jobs) return ERR_NOMEM;
+
+  int rc = SUCCESS;
+  for (int i = 0; i < count; i++) {
+    lc_job_t *job = jobs[i] = job_alloc(tp, w);
+    if (!job) {
+      // give back what we have so far through the shared cache
+      lc_spin_lock(tp->lock);
+      while (i--) {
+        jobs[i]->next = tp->spare;
+        tp->spare = jobs[i];
+      }
+      lc_spin_unlock(tp->lock);
+      rc = ERR_NOMEM;
+      break;
+    }
+    job->fn = fn;
+    job->data = data[i];
+    job->pooled = 1;
+    job->node = -1;
+    job->prio = LC_PRIO_NORMAL;
+    job->worker = 0;
+  }
+
+  if (rc == SUCCESS) {
+    rc = lc_threadpool_submit_batch(tp, jobs, count);
+  }
+  if (jobs != small) lc_free(jobs);
+  return rc;
+}
+
+int lc_threadpool_quit(lc_threadpool_t *pool);
+
+int lc_threadpool_set_threads(lc_threadpool_t *tp, int min, int max) {
+  if (!tp) return ERR_INVAL;
   lc_spin_lock(tp->lock);
-  queue_push(&tp->jobs,job);
-  lc_sem_post(tp->sem);
-  jobs = queue_size(&tp->jobs);
+  tp->min_threads = clamp_threads(min);
+  tp->max_threads = clamp_threads(max);
+  lc_spin_unlock(tp->lock);
 
-  if ((tp->threads < tp->min_threads) || (jobs > 1 && tp->threads < tp->max_threads)) {
-    pthread_t tid;
-    int rc = pthread_create(&tid,NULL,pool_thread,tp);
-    printf("Started thread (%d:%d:%d) rc = %d\n",tp->threads,tp->min_threads,tp->max_threads,rc);
-    if (rc == 0) {
-      atomic_int_inc(&tp->threads);
+  return SUCCESS;
+}
+
+int lc_threadpool_set_targets(lc_threadpool_t *tp, int delay_usec, int idle_millis) {
+  if (!tp || delay_usec < 0 || idle_millis < 0) return ERR_INVAL;
+  tp->target_delay = delay_usec;
+  tp->idle_millis = idle_millis;
+  return SUCCESS;
+}
+
+/*
+ * Chooses how the priority classes share the pool. Weights (one per class, highest class
+ * first) only matter to LC_SCHED_WEIGHTED and may be NULL to keep the current ones. A
+ * starve_usec of zero turns starvation protection off.
+ */
+int lc_threadpool_set_priority(lc_threadpool_t *tp, int policy, const int *weights, int starve_usec) {
+  if (!tp || starve_usec < 0) return ERR_INVAL;
+  if (policy != LC_SCHED_STRICT && policy != LC_SCHED_WEIGHTED) return ERR_INVAL;
+  if (weights) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+      if (weights[i] < 1) return ERR_INVAL;
     }
   }
 
+  lc_spin_lock(tp->lock);
+  tp->policy = policy;
+  tp->starve_usec = starve_usec;
+  if (weights) {
+    for (int i = 0; i < POOL_CLASSES; i++) {
+      tp->weights[i] = weights[i];
+    }
+  }
   lc_spin_unlock(tp->lock);
 
   return SUCCESS;
 }
 
-int lc_threadpool_quit(lc_threadpool_t *pool);
+int lc_threadpool_policy(lc_threadpool_t *tp) {
+  if (!tp) return ERR_INVAL;
+  return tp->policy;
+}
 
-int lc_threadpool_set_threads(lc_threadpool_t *tp, int min, int max) {
+/*
+ * Sets a function for idle workers to call each time they have waited idle_millis without
+ * finding work, for housekeeping that should stay off the busy path.
+ */
+int lc_threadpool_set_idle_hook(lc_threadpool_t *tp, threadpool_fn fn, void *data) {
   if (!tp) return ERR_INVAL;
   lc_spin_lock(tp->lock);
-  tp->min_threads = min;
-  tp->max_threads = max;
+  tp->idle_data = data;
+  tp->idle_hook = fn;
   lc_spin_unlock(tp->lock);
+  return SUCCESS;
+}
+
+int lc_threadpool_target_delay(lc_threadpool_t *tp) {
+  if (!tp) return ERR_INVAL;
+  return tp->target_delay;
+}
+
+int lc_threadpool_idle_millis(lc_threadpool_t *tp) {
+  if (!tp) return ERR_INVAL;
+  return tp->idle_millis;
+}
+
+#ifdef __linux__
+static int parse_cpulist(const char *list, cpu_set_t *set) {
+  CPU_ZERO(set);
+  const char *p = list;
+  while (*p) {
+    char *end;
+    long lo = strtol(p, &end, 10);
+    if (end == p) break;
+    long hi = lo;
+    if (*end == '-') {
+      p = end + 1;
+      hi = strtol(p, &end, 10);
+    }
+    for (long cpu = lo; cpu <= hi && cpu < POOL_MAX_CPUS; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    p = (*end == ',') ? end + 1 : end;
+    if (*p == '\n') break;
+  }
+  return CPU_COUNT(set);
+}
+
+static int discover_nodes(lc_threadpool_t *tp) {
+  int nnodes = 0;
+  for (int n = 0; n < POOL_MAX_NODES; n++) {
+    char path[64], list[1024];
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+    FILE *f = fopen(path, "r");
+    if (!f) break;
+    if (fgets(list, sizeof(list), f) && parse_cpulist(list, &tp->nodes[n].cpus)) {
+      nnodes = n + 1;
+    }
+    fclose(f);
+  }
+  return nnodes;
+}
+
+/*
+ * Sets where newly started workers run. A list of CPUs pins each worker to one of them,
+ * and numa groups the workers by node so that node-directed jobs stay on the node. Threads
+ * that are already running keep their placement, and jobs already queued for a node that
+ * no longer exists are left for any worker to steal.
+ */
+int lc_threadpool_set_affinity(lc_threadpool_t *tp, const int *cpus, int ncpus, int numa) {
+  if (!tp || ncpus < 0 || (ncpus && !cpus)) return ERR_INVAL;
+
+  int *copy = NULL;
+  if (ncpus) {
+    copy = lc_alloc(sizeof(int) * ncpus);
+    if (!copy) return ERR_NOMEM;
+    for (int i = 0; i < ncpus; i++) {
+      if (cpus[i] < 0 || cpus[i] >= POOL_MAX_CPUS) {
+        lc_free(copy);
+        return ERR_INVAL;
+      }
+      copy[i] = cpus[i];
+    }
+  }
+
+  lc_spin_lock(tp->lock);
+  lc_free(tp->cpus);
+  tp->cpus = copy;
+  tp->ncpus = ncpus;
+  tp->nnodes = numa ? discover_nodes(tp) : 0;
+  for (int i = 0; i < POOL_MAX_CPUS; i++) {
+    tp->cpu_node[i] = -1;
+  }
+  for (int n = 0; n < tp->nnodes; n++) {
+    for (int i = 0; i < POOL_MAX_CPUS; i++) {
+      if (CPU_ISSET(i, &tp->nodes[n].cpus)) tp->cpu_node[i] = n;
+    }
+  }
+  lc_spin_unlock(tp->lock);
+
+  return SUCCESS;
+}
+
+int lc_threadpool_current_node(lc_threadpool_t *tp) {
+  if (!tp) return ERR_INVAL;
+  if (tp->nnodes == 0) return -1;
+  int cpu = sched_getcpu();
+  return (cpu < 0 || cpu >= POOL_MAX_CPUS) ? -1 : tp->cpu_node[cpu];
+}
+#else
+int lc_threadpool_set_affinity(lc_threadpool_t *tp, const int *cpus, int ncpus, int numa) {
+  return ERR_UNSUPPORTED;
+}
+
+int lc_threadpool_current_node(lc_threadpool_t *tp) {
+  return -1;
+}
+#endif
+
+int lc_threadpool_nodes(lc_threadpool_t *tp) {
+  if (!tp) return ERR_INVAL;
+  return tp->nnodes;
+}
+
+static uint64_t wait_percentile(const uint64_t *hist, uint64_t total, int pct) {
+  if (total == 0) return 0;
+  uint64_t rank = (total * pct + 99) / 100;
+  uint64_t seen = 0;
+  for (int b = 0; b < POOL_HIST_BUCKETS; b++) {
+    seen += hist[b];
+    if (seen >= rank) return b ? 1ULL << b : 0;
+  }
+  return 1ULL << (POOL_HIST_BUCKETS - 1);
+}
+
+/*
+ * Takes a snapshot of the pool's counters. The numbers are read without stopping the
+ * workers, so they are only consistent with each other to within the jobs in flight.
+ */
+int lc_threadpool_stats(lc_threadpool_t *tp, lc_pool_stats_t *stats) {
+  if (!tp || !stats) return ERR_INVAL;
+  memset(stats, 0, sizeof(lc_pool_stats_t));
+
+  stats->threads = tp->threads;
+  stats->idle = tp->idle;
+  stats->created = atomic_int_get_relaxed(&tp->created);
+  stats->retired = atomic_int_get_relaxed(&tp->retired);
+  stats->queued = jobq_size(&tp->jobs);
+  for (int i = 0; i < POOL_MAX_NODES; i++) {
+    stats->queued += jobq_size(&tp->nodes[i].jobs);
+  }
+
+  for (int i = 0; i < POOL_MAX_THREADS; i++) {
+    lc_worker_t *w = &tp->workers[i];
+    lc_worker_stats_t *ws = &stats->workers[i];
+    ws->active = atomic_int_get_relaxed(&w->active);
+    ws->queued = jobq_size(&w->jobs);
+    ws->executed = w->executed;
+    ws->busy_usec = w->busy_usec;
+    ws->affinity_hits = w->affinity_hits;
+    ws->affinity_misses = w->affinity_misses;
+    stats->queued += ws->queued;
+    stats->executed += ws->executed;
+    stats->busy_usec += ws->busy_usec;
+    stats->affinity_hits += ws->affinity_hits;
+    stats->affinity_misses += ws->affinity_misses;
+    for (int b = 0; b < POOL_HIST_BUCKETS; b++) {
+      stats->wait_hist[b] += w->wait_hist[b];
+    }
+  }
 
+  stats->wait_p50 = wait_percentile(stats->wait_hist, stats->executed, 50);
+  stats->wait_p90 = wait_percentile(stats->wait_hist, stats->executed, 90);
+  stats->wait_p99 = wait_percentile(stats->wait_hist, stats->executed, 99);
   return SUCCESS;
 }
 
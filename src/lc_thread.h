@@ -3,6 +3,7 @@
 
 #include "casting.h"
 #include "lc_error.h"
+#include "lc_atomic.h"
 
 void init_thread( );
 
@@ -10,28 +11,30 @@ typedef struct _lc_mutex lc_mutex_t;
 typedef struct _lc_spin lc_spin_t;
 typedef struct _lc_sem lc_sem_t;
 typedef struct _lc_cond lc_cond_t;
+typedef struct _lc_event lc_event_t;
 typedef struct _local lc_local_t;
 typedef struct _lc_threadpool lc_threadpool_t;
 
-void *atomic_ptr_get(volatile void *addr);
-void atomic_ptr_set(volatile void *addr,void *p);
-int atomic_ptr_cas(volatile void *addr, void *o, void *n);
-int atomic_int_get(volatile int *addr);
-void atomic_int_set(volatile int *addr,int i);
-int atomic_int_cas(volatile int *addr, int o, int n);
-int atomic_int_tas(volatile int *addr,int n);
-int atomic_int_add(volatile int *addr, int i);
-int atomic_int_sub(volatile int *addr, int i);
-int atomic_int_inc(volatile int *addr);
-int atomic_int_dec(volatile int *addr);
-
 lc_mutex_t *lc_mutex_new( );
 int lc_mutex_lock(lc_mutex_t *mtx);
 int lc_mutex_unlock(lc_mutex_t *mtx);
 int lc_mutex_trylock(lc_mutex_t *mtx);
 int lc_mutex_destroy(lc_mutex_t *mtx);
 
+typedef enum {
+  LC_SPIN_ADAPTIVE = 0, LC_SPIN_TICKET
+} lc_spin_type_t;
+
+// lock type handed out by lc_spin_new(), override with -DLC_SPIN_DEFAULT=LC_SPIN_TICKET
+#ifndef LC_SPIN_DEFAULT
+#define LC_SPIN_DEFAULT     LC_SPIN_ADAPTIVE
+#endif
+
+#define SPIN_TRIES          10
+#define SPIN_BACKOFF_MAX    64
+
 lc_spin_t *lc_spin_new( );
+lc_spin_t *lc_spin_new_type(lc_spin_type_t type);
 int lc_spin_lock(lc_spin_t *s);
 int lc_spin_trylock(lc_spin_t *s);
 int lc_spin_unlock(lc_spin_t *s);
@@ -51,19 +54,121 @@ int lc_cond_wait(lc_cond_t *cond, lc_mutex_t *mtx);
 int lc_cond_timedwait(lc_cond_t *cond, lc_mutex_t *mtx, long millis);
 int lc_cond_destroy(lc_cond_t *cond);
 
+#define EVENT_SPINS         100
+
+lc_event_t *lc_event_new( );
+lc_event_t *lc_event_local( );
+int lc_event_prepare(lc_event_t *ev);
+int lc_event_cancel(lc_event_t *ev);
+int lc_event_wait(lc_event_t *ev, int key, long millis);
+int lc_event_waiters(lc_event_t *ev);
+int lc_event_notify(lc_event_t *ev);
+int lc_event_notify_n(lc_event_t *ev, int count);
+int lc_event_notify_all(lc_event_t *ev);
+int lc_event_destroy(lc_event_t *ev);
+
+uint64_t lc_clock_usec( );
+int lc_thread_sleep(long millis);
+
 lc_local_t *lc_local_new(void (*destroy_fn)(void *));
 int lc_local_set(lc_local_t *local, const void *val);
 void *lc_local_get(lc_local_t *local);
 int lc_local_destroy(lc_local_t *local);
 
 #define THREAD_WAIT_MILLIS  2500
+#define POOL_TARGET_DELAY   500
+#define POOL_MAX_THREADS    64
+#define POOL_MAX_NODES      8
+#define POOL_MAX_CPUS       1024
+#define CACHE_LINE          64
+#define JOB_CACHE_MAX       256
+#define BATCH_SIZE          64
+#define POOL_LOCAL          -2
+#define POOL_SHARED         -1
+#define POOL_WORKER(slot)   (POOL_MAX_NODES + (slot))
+#define POOL_CLASSES        3
+#define POOL_STARVE_USEC    50000
+#define POOL_HIST_BUCKETS   24
+
+typedef enum {
+  LC_PRIO_HIGH=0, LC_PRIO_NORMAL, LC_PRIO_LOW
+} lc_prio_t;
+
+typedef enum {
+  LC_SCHED_STRICT=0, LC_SCHED_WEIGHTED
+} lc_sched_t;
 
 typedef void (*threadpool_fn)(void *values);
 
+/*
+ * A unit of work for the pool. Callers that dispatch the same work repeatedly can embed one
+ * of these and hand it to lc_threadpool_submit(), which never allocates. The job must not
+ * be resubmitted until its function has started running. prio is one of lc_prio_t and is
+ * left to the caller to set, as is worker, which should start at zero: the pool keeps the
+ * (one based) slot of the worker that last ran the job there, and prefers it next time.
+ */
+typedef struct _lc_job {
+  struct _lc_job *next;
+  threadpool_fn fn;
+  void *data;
+  int pooled;
+  int node;
+  int prio;
+  int worker;
+  uint64_t queued;
+} lc_job_t;
+
+typedef struct _lc_worker_stats {
+  int active;
+  int queued;
+  uint64_t executed;
+  uint64_t busy_usec;
+  uint64_t affinity_hits;
+  uint64_t affinity_misses;
+} lc_worker_stats_t;
+
+/*
+ * Pool counters as returned by lc_threadpool_stats(). Queueing delays are kept in log2
+ * buckets (wait_hist[b] counts jobs that waited less than 2^b usec), and the percentiles
+ * are the upper bounds of the buckets they fall in.
+ */
+typedef struct _lc_pool_stats {
+  int threads;
+  int idle;
+  int queued;
+  int created;
+  int retired;
+  uint64_t executed;
+  uint64_t busy_usec;
+  uint64_t affinity_hits;
+  uint64_t affinity_misses;
+  uint64_t wait_p50;
+  uint64_t wait_p90;
+  uint64_t wait_p99;
+  uint64_t wait_hist[POOL_HIST_BUCKETS];
+  lc_worker_stats_t workers[POOL_MAX_THREADS];
+} lc_pool_stats_t;
+
+int lc_thread_start(threadpool_fn fn, void *data);
+
 lc_threadpool_t *lc_threadpool_new(int min, int max);
 int lc_threadpool_quit(lc_threadpool_t *pool);
 int lc_threadpool_run(lc_threadpool_t *pool, threadpool_fn fn, void *data);
+int lc_threadpool_submit(lc_threadpool_t *pool, lc_job_t *job);
+int lc_threadpool_submit_node(lc_threadpool_t *pool, lc_job_t *job, int node);
+int lc_threadpool_submit_batch(lc_threadpool_t *pool, lc_job_t **jobs, int count);
+int lc_threadpool_run_batch(lc_threadpool_t *pool, threadpool_fn fn, void **data, int count);
 int lc_threadpool_set_threads(lc_threadpool_t *pool,int min, int max);
+int lc_threadpool_set_targets(lc_threadpool_t *pool, int delay_usec, int idle_millis);
+int lc_threadpool_set_priority(lc_threadpool_t *pool, int policy, const int *weights, int starve_usec);
+int lc_threadpool_policy(lc_threadpool_t *pool);
+int lc_threadpool_set_idle_hook(lc_threadpool_t *pool, threadpool_fn fn, void *data);
+int lc_threadpool_target_delay(lc_threadpool_t *pool);
+int lc_threadpool_idle_millis(lc_threadpool_t *pool);
+int lc_threadpool_set_affinity(lc_threadpool_t *pool, const int *cpus, int ncpus, int numa);
+int lc_threadpool_current_node(lc_threadpool_t *pool);
+int lc_threadpool_nodes(lc_threadpool_t *pool);
+int lc_threadpool_stats(lc_threadpool_t *pool, lc_pool_stats_t *stats);
 int lc_threadpool_min(lc_threadpool_t *pool);
 int lc_threadpool_max(lc_threadpool_t *pool);
 
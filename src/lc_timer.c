@@ -0,0 +1,259 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "casting.h"
+#include "lc_thread.h"
+#include "lc_timer.h"
+
+#define TIMER_MASK        (TIMER_SLOTS - 1)
+#define TIMER_NEVER       UINT64_MAX
+#define TIMER_RANGE       (1ULL << (TIMER_SLOT_BITS * TIMER_LEVELS))
+
+// each slot is the sentinel of a circular list of the timers in it
+static lc_timer_t wheel[TIMER_LEVELS][TIMER_SLOTS];
+static pthread_once_t wheel_once = PTHREAD_ONCE_INIT;
+static lc_spin_t *wheel_lock;          // NULL if the wheel couldn't be set up
+static lc_event_t *wheel_event;
+static uint64_t wheel_start;           // the clock at tick zero
+static uint64_t wheel_tick = 0;        // the next tick to be run
+static uint64_t wheel_wake = TIMER_NEVER;  // the tick the timer thread sleeps until
+static volatile int wheel_count = 0;
+
+// the callbacks of the timers that expired in one pass, run once the wheel is unlocked
+typedef struct _expiry {
+  timer_fn fn;
+  void *data;
+} expiry_t;
+
+static expiry_t *expired = NULL;
+static int nexpired = 0;
+static int expired_size = 0;
+
+static void timer_thread(void *data);
+
+/*
+ * Sets up the wheel and its thread for the first timer started, on whichever thread that
+ * is, so it runs under pthread_once(). Should any of it fail, no timer can ever start.
+ */
+static void timer_init( ) {
+  for (int l = 0; l < TIMER_LEVELS; l++) {
+    for (int i = 0; i < TIMER_SLOTS; i++) {
+      wheel[l][i].next = wheel[l][i].prev = &wheel[l][i];
+    }
+  }
+  wheel_lock = lc_spin_new();
+  wheel_event = lc_event_new();
+  wheel_start = lc_clock_usec();
+  if (!wheel_lock || !wheel_event || lc_thread_start(timer_thread, NULL) != SUCCESS) {
+    if (wheel_lock) lc_spin_destroy(wheel_lock);
+    if (wheel_event) lc_event_destroy(wheel_event);
+    wheel_lock = NULL;
+    wheel_event = NULL;
+    INFO("Unable to start the timer thread");
+    return;
+  }
+  INFO("Initialized timers");
+}
+
+static int timer_setup( ) {
+  pthread_once(&wheel_once, timer_init);
+  return wheel_lock ? SUCCESS : ERR_THREADFAIL;
+}
+
+static inline uint64_t timer_now( ) {
+  return (lc_clock_usec() - wheel_start) / TIMER_TICK_USEC;
+}
+
+void lc_timer_init(lc_timer_t *t, timer_fn fn, void *data) {
+  memset(t, 0, sizeof(lc_timer_t));
+  t->slot = TIMER_IDLE;
+  t->fn = fn;
+  t->data = data;
+}
+
+/*
+ * Puts a timer in the slot for its expiry on the lowest level that reaches it from the
+ * current tick. Timers beyond the top level wait in its furthest slot and are placed again
+ * when the wheel gets there. Must be called with the wheel locked.
+ */
+static void wheel_insert(lc_timer_t *t) {
+  uint64_t expires = t->expires < wheel_tick ? wheel_tick : t->expires;
+  uint64_t delta = expires - wheel_tick;
+  if (delta >= TIMER_RANGE) {
+    expires = wheel_tick + TIMER_RANGE - 1;
+    delta = TIMER_RANGE - 1;
+  }
+
+  int level = 0;
+  while (delta >= (1ULL << (TIMER_SLOT_BITS * (level + 1)))) level++;
+  int idx = (expires >> (TIMER_SLOT_BITS * level)) & TIMER_MASK;
+
+  lc_timer_t *head = &wheel[level][idx];
+  t->slot = level * TIMER_SLOTS + idx;
+  t->next = head;
+  t->prev = head->prev;
+  head->prev->next = t;
+  head->prev = t;
+}
+
+static inline void wheel_unlink(lc_timer_t *t) {
+  t->prev->next = t->next;
+  t->next->prev = t->prev;
+  t->next = t->prev = NULL;
+  t->slot = TIMER_IDLE;
+}
+
+// moves the timers of a slot on a higher level down to where they now belong
+static void wheel_cascade(int level, int idx) {
+  lc_timer_t *head = &wheel[level][idx];
+  lc_timer_t *t = head->next;
+  head->next = head->prev = head;
+  while (t != head) {
+    lc_timer_t *next = t->next;
+    wheel_insert(t);
+    t = next;
+  }
+}
+
+static int expired_push(lc_timer_t *t) {
+  if (nexpired == expired_size) {
+    int size = expired_size ? expired_size * 2 : TIMER_SLOTS;
+    expiry_t *e = lc_realloc(expired, sizeof(expiry_t) * expired_size, sizeof(expiry_t) * size);
+    if (!e) return ERR_NOMEM;
+    expired = e;
+    expired_size = size;
+  }
+  expired[nexpired].fn = t->fn;
+  expired[nexpired].data = t->data;
+  nexpired++;
+  return SUCCESS;
+}
+
+/*
+ * Runs the wheel up to the current tick, collecting the callbacks of the timers that have
+ * expired. When the wheel is empty there is nothing to run, and it jumps straight there.
+ * Must be called with the wheel locked.
+ */
+static void wheel_advance(uint64_t now) {
+  if (wheel_count == 0) {
+    if (wheel_tick <= now) wheel_tick = now + 1;
+    return;
+  }
+
+  while (wheel_tick <= now) {
+    int idx = wheel_tick & TIMER_MASK;
+    // each time a level comes round, the next slot of the level above moves down
+    for (int l = 1; l < TIMER_LEVELS; l++) {
+      if ((wheel_tick >> (TIMER_SLOT_BITS * (l - 1))) & TIMER_MASK) break;
+      wheel_cascade(l, (wheel_tick >> (TIMER_SLOT_BITS * l)) & TIMER_MASK);
+    }
+
+    lc_timer_t *head = &wheel[0][idx];
+    while (head->next != head) {
+      lc_timer_t *t = head->next;
+      if (expired_push(t) != SUCCESS) return; // try again once some memory is free
+      wheel_unlink(t);
+      wheel_count--;
+    }
+    wheel_tick++;
+  }
+}
+
+// the tick the timer thread next has work at: the next timer due or the next cascade
+static uint64_t wheel_next( ) {
+  if (wheel_count == 0) return TIMER_NEVER;
+  // on a boundary the timers due next are still on the level above
+  if (!(wheel_tick & TIMER_MASK)) return wheel_tick;
+  uint64_t end = (wheel_tick | TIMER_MASK) + 1;
+  for (uint64_t t = wheel_tick; t < end; t++) {
+    lc_timer_t *head = &wheel[0][t & TIMER_MASK];
+    if (head->next != head) return t;
+  }
+  return end;
+}
+
+static void timer_thread(void *data) {
+  for (;;) {
+    int key = lc_event_prepare(wheel_event);
+
+    lc_spin_lock(wheel_lock);
+    wheel_advance(timer_now());
+    uint64_t wake = wheel_wake = wheel_next();
+    lc_spin_unlock(wheel_lock);
+
+    for (int i = 0; i < nexpired; i++) {
+      expired[i].fn(expired[i].data);
+    }
+    nexpired = 0;
+
+    long millis = -1;
+    if (wake != TIMER_NEVER) {
+      uint64_t at = wheel_start + wake * TIMER_TICK_USEC;
+      uint64_t now = lc_clock_usec();
+      millis = at > now ? (at - now + 999) / 1000 : 0;
+    }
+    if (millis == 0) {
+      lc_event_cancel(wheel_event);
+    } else {
+      lc_event_wait(wheel_event, key, millis);
+    }
+  }
+}
+
+/*
+ * Starts a timer that calls its function once, millis from now. A timer that is already
+ * running has to be cancelled before it can be started again. Returns ERR_THREADFAIL if
+ * the timer thread couldn't be started.
+ */
+int lc_timer_start(lc_timer_t *t, long millis) {
+  if (!t || !t->fn || millis < 0) return ERR_INVAL;
+  if (timer_setup() != SUCCESS) return ERR_THREADFAIL;
+
+  // a timer never fires early, so round its expiry up to a whole tick
+  uint64_t at = lc_clock_usec() - wheel_start + (uint64_t) millis * 1000;
+  uint64_t expires = (at + TIMER_TICK_USEC - 1) / TIMER_TICK_USEC;
+
+  lc_spin_lock(wheel_lock);
+  if (t->slot != TIMER_IDLE) {
+    lc_spin_unlock(wheel_lock);
+    return ERR_BUSY;
+  }
+  // the timer thread only moves an empty wheel on when it wakes up, which could be a while
+  if (wheel_count == 0) {
+    uint64_t now = timer_now();
+    if (wheel_tick <= now) wheel_tick = now + 1;
+  }
+  t->expires = expires;
+  wheel_insert(t);
+  wheel_count++;
+  int wake = expires < wheel_wake;
+  lc_spin_unlock(wheel_lock);
+
+  if (wake) lc_event_notify(wheel_event);
+  return SUCCESS;
+}
+
+/*
+ * Stops a timer before it fires. Once a timer has expired this returns ERR_NOTFOUND, and
+ * its function has been called or is about to be.
+ */
+int lc_timer_cancel(lc_timer_t *t) {
+  if (!t) return ERR_INVAL;
+  // nothing can be pending on a wheel that was never set up
+  if (timer_setup() != SUCCESS) return ERR_NOTFOUND;
+
+  int rc = ERR_NOTFOUND;
+  lc_spin_lock(wheel_lock);
+  if (t->slot != TIMER_IDLE) {
+    wheel_unlink(t);
+    wheel_count--;
+    rc = SUCCESS;
+  }
+  lc_spin_unlock(wheel_lock);
+  return rc;
+}
+
+int lc_timer_count( ) {
+  return atomic_int_get(&wheel_count);
+}
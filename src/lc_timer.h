@@ -0,0 +1,37 @@
+#ifndef __LC_TIMER_H__
+#define __LC_TIMER_H__
+
+#include <stdint.h>
+#include "lc_error.h"
+
+/*
+ * Timers live on a hierarchical wheel serviced by a single timer thread: TIMER_LEVELS
+ * levels of TIMER_SLOTS slots, each level counting in ticks of the slots below it. A timer
+ * goes in the slot for its expiry on the lowest level that reaches that far, and moves down
+ * a level each time the wheel comes round to its slot, so starting and cancelling a timer
+ * are both constant time however many are pending. Timers are embedded by their owners
+ * like pool jobs, and their callbacks run on the timer thread, so should be quick.
+ */
+#define TIMER_TICK_USEC     1000
+#define TIMER_SLOT_BITS     8
+#define TIMER_SLOTS         (1 << TIMER_SLOT_BITS)
+#define TIMER_LEVELS        4
+#define TIMER_IDLE          -1
+
+typedef void (*timer_fn)(void *data);
+
+typedef struct _lc_timer {
+  struct _lc_timer *next;
+  struct _lc_timer *prev;
+  uint64_t expires;    // in ticks
+  int slot;            // where on the wheel the timer is, TIMER_IDLE when it isn't
+  timer_fn fn;
+  void *data;
+} lc_timer_t;
+
+void lc_timer_init(lc_timer_t *t, timer_fn fn, void *data);
+int lc_timer_start(lc_timer_t *t, long millis);
+int lc_timer_cancel(lc_timer_t *t);
+int lc_timer_count( );
+
+#endif // __LC_TIMER_H__
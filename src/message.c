@@ -45,6 +45,16 @@ message_t *msg_new(message_builder_t *mb) {
 
   size_t v_size = mb->last;
   msg = lc_alloc(sizeof(message_t) + mb->bytes);
+  if (!msg) {
+    // the builder still owns the dumped functions and userdata, and its own buffers
+    for (int i = 0; i < mb->last; i++) {
+      int type = value_type(&mb->values[i]);
+      if (type == T_USERDATA || type == T_FUNCTION) lc_free((void *) mb->values[i].ptr);
+    }
+    if (mb->values != mb->buf) lc_free(mb->values);
+    if (mb->refmap) map_free(mb->refmap);
+    return NULL;
+  }
   msg->ref_count = 1;
   msg->count = mb->count;
   msg->refs = mb->refs;
@@ -95,15 +105,67 @@ message_t *msg_new(message_builder_t *mb) {
 
 message_t *msg_ref(message_t *m) {
   if (m) {
-    atomic_int_inc(&m->ref_count);
+    atomic_ref_inc(&m->ref_count);
   }
   return m;
 }
 
+/*
+ * Joins the values of n messages into one new message, consuming the originals. References
+ * point at values by their position in the message, so those of each part are moved on by
+ * the number of values ahead of it.
+ */
+message_t *msg_concat(message_t **ms, int n) {
+  if (!ms || n <= 0) return NULL;
+
+  size_t bytes = 0;
+  int count = 0, refs = 0;
+  for (int i = 0; i < n; i++) {
+    bytes += ms[i]->size - sizeof(message_t);
+    count += ms[i]->count;
+    refs += ms[i]->refs;
+  }
+
+  message_t *msg = lc_alloc(sizeof(message_t) + bytes);
+  if (!msg) return NULL;
+  msg->ref_count = 1;
+  msg->count = count;
+  msg->refs = refs;
+  msg->size = sizeof(message_t) + bytes;
+
+  char *p = msg->data;
+  int base = 0;
+  for (int i = 0; i < n; i++) {
+    size_t len = ms[i]->size - sizeof(message_t);
+    memcpy(p, ms[i]->data, len);
+
+    if (refs) {
+      msg_cursor_t cur;
+      value_t v;
+      msg_cursor_init(&cur, ms[i]);
+      for (;;) {
+        int pos = cur.pos;
+        if (msg_next(&cur, &v) < 0) break;
+        if (value_type(&v) == T_REFERENCE && base) {
+          int ref = v.data.ref + base;
+          memcpy(p + pos + sizeof(v.type), &ref, sizeof(ref));
+        }
+      }
+      base += cur.count;
+    }
+    p += len;
+  }
+
+  for (int i = 0; i < n; i++) {
+    msg_destroy(ms[i]);
+  }
+  return msg;
+}
+
 int msg_destroy(message_t *m) {
   if (!m) return ERR_INVAL;
 
-  if (atomic_int_dec(&m->ref_count) == 0) {
+  if (atomic_ref_dec(&m->ref_count) == 0) {
     lc_free(m);
   }
   return SUCCESS;
@@ -157,7 +219,7 @@ int lc_pushreference(message_builder_t *mb, int ref) {
   value_t *v = &mb->values[idx];
   v->type = T_REFERENCE;
   v->data.ref = ref;
-  mb->bytes += sizeof(v->data.ref);
+  mb->bytes += sizeof(v->type) + sizeof(v->data.ref);
   ++mb->count;
   return idx;
 }
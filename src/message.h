@@ -113,6 +113,7 @@ int lc_setmeta(message_builder_t *mb, int idx);
 
 message_t *msg_new(message_builder_t *mb);
 message_t *msg_ref(message_t *m);
+message_t *msg_concat(message_t **ms, int n);
 int msg_count(const message_t *m);
 int msg_destroy(message_t *m);
 
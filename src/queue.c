@@ -81,6 +81,28 @@ void *queue_peek(queue_t *q) {
   }
 }
 
+/*
+ * Takes the first element that match() compares equal to key out of the queue, wherever it
+ * is, and returns it without releasing it.
+ */
+void *queue_remove(queue_t *q, compare_cb match, const void *key) {
+  if (!q || !match) return NULL;
+  q_node_t *prev = &q->head;
+  q_node_t *n;
+  while ((n = prev->next)) {
+    if (match(n->data, key) == 0) {
+      prev->next = n->next;
+      if (q->tail == n) q->tail = prev;
+      void *p = n->data;
+      lc_free(n);
+      q->size--;
+      return p;
+    }
+    prev = n;
+  }
+  return NULL;
+}
+
 int queue_clear(queue_t *q) {
   if (!q) return ERR_INVAL;
   void *d = NULL;
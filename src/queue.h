@@ -25,5 +25,6 @@ int queue_free(queue_t *q);
 int queue_isempty(queue_t *q);
 int queue_size(queue_t *q);
 void *queue_peek(queue_t *q);
+void *queue_remove(queue_t *q, compare_cb match, const void *key);
 
 #endif // __QUEUE_H__
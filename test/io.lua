@@ -0,0 +1,55 @@
+-- IO on pipes and socket pairs: reads, writes, timeouts, and IO.close() handing a
+-- descriptor over from under a task waiting on it
+local casting = require "casting"
+local IO = casting.IO
+
+-- outside a session the calling thread waits itself
+local r, w = IO.pipe()
+assert(IO.write(w, "hello") == 5)
+assert(IO.read(r) == "hello")
+local v, err = IO.read(r, 16, 10)
+assert(v == nil and err == "timeout")
+IO.close(w)
+v, err = IO.read(r)
+assert(v == nil and err == "closed")
+IO.close(r)
+
+-- descriptors from elsewhere have to be made non-blocking first
+local f = io.tmpfile()
+f:write("data")
+f:flush()
+f:seek("set")
+assert(not pcall(IO.read, f))
+IO.nonblock(f)
+assert(IO.read(f) == "data")
+f:close()
+
+-- in a task the reactor does the waiting
+local a, b = IO.socketpair()
+local out = casting.Channel.new()
+local s = casting.Session.new()
+s:create(function(fd, out)
+  local IO = require("casting").IO
+  out:write(IO.read(fd))
+  out:write(IO.read(fd, 16, 10))
+  out:write("waiting")
+  out:write(IO.read(fd))
+end, a, out)
+
+assert(IO.write(b, "ping") == 4)
+assert(out:read() == "ping")
+v, err = out:read()
+assert(v == nil and err == "timeout")
+
+-- give the task time to start waiting again, then close its descriptor
+assert(out:read() == "waiting")
+local pr, pw = IO.pipe()
+IO.read(pr, 1, 100)
+assert(IO.close(a))
+v, err = out:read()
+assert(v == nil and err)
+
+IO.close(pr)
+IO.close(pw)
+IO.close(b)
+s:close()
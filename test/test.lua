@@ -0,0 +1,7 @@
+-- Runs the tests in this directory, for the Makefile's test target
+local tests = { "io" }
+
+for _, name in ipairs(tests) do
+  dofile(name .. ".lua")
+  print(name .. " ok")
+end